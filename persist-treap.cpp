@@ -1,428 +1,7405 @@
 #include <memory>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <tuple>
+#include <utility>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <atomic>
+#include <limits>
+#include <random>
+#include <array>
+#include <optional>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 using namespace std;
 
-template <typename Tkey, typename Tval>
+//------------------------------------------------------------------------------------------------------------
+// Node allocation
+//------------------------------------------------------------------------------------------------------------
+
+//Every clone made during split/join/union is a separate make_shared call, so a single insert goes through
+//the global heap O(log n) times.  NodePool is a size-class pool: all blocks of one size class live on a
+//free list, and new blocks are carved out of big chunks.  Each thread has its own free list so the common
+//path has no locking.  A block freed on a different thread than it was allocated on just lands on the other
+//thread's free list, which is fine since all blocks of a size class are interchangeable.
+//
+//The chunks are never handed back to the operating system.  The pool can't know when the last version
+//holding a node goes away, so instead freed blocks are kept around to be reused by later versions.
+//
+//A thread that frees nodes but never allocates any, like the background thread of Reclaimer (see below),
+//would just pile up blocks nobody reuses.  Such a thread sets NodePoolGiveBack::enabled(), and then hands
+//its free list over to the global list every time it grows past a chunk, and allocates straight from
+//operator new.
+
+struct NodePoolGiveBack {
+    static bool& enabled() {
+        static thread_local bool e = false;
+        return e;
+    }
+};
+
+template <size_t Size>
+struct NodePool {
+    private:
+
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        static const size_t blocks_per_chunk = 1024;
+
+        //When a thread exits, its free list is moved here so another thread can reuse the blocks.
+        struct Global {
+            mutex lock;
+            FreeBlock* free_list = nullptr;
+        };
+
+        static Global& global() {
+            static Global g;
+            return g;
+        }
+
+        //Set once the thread's Local has been destroyed.  Nodes can still be freed after that point (for
+        //example by a static treap at exit), in which case they go straight to the global list.
+        static bool& local_dead() {
+            static thread_local bool dead = false;
+            return dead;
+        }
+
+        static void push_global(FreeBlock* first, FreeBlock* last) {
+            Global& g = global();
+            lock_guard<mutex> guard(g.lock);
+            last->next = g.free_list;
+            g.free_list = first;
+        }
+
+        struct Local {
+            FreeBlock* free_list = nullptr;
+            //the end of the list and its length, only kept up to date on NodePoolGiveBack threads
+            FreeBlock* last = nullptr;
+            size_t count = 0;
+
+            ~Local() {
+                local_dead() = true;
+                if (!free_list) {
+                    return;
+                }
+                //find the end of the list and splice it in front of the global list
+                FreeBlock* tail = free_list;
+                while (tail->next) {
+                    tail = tail->next;
+                }
+                push_global(free_list, tail);
+            }
+        };
+
+        static Local& local() {
+            static thread_local Local l;
+            return l;
+        }
+
+        static FreeBlock* refill() {
+            //First try and steal the blocks left behind by threads that exited
+            {
+                Global& g = global();
+                lock_guard<mutex> guard(g.lock);
+                if (g.free_list) {
+                    FreeBlock* list = g.free_list;
+                    g.free_list = nullptr;
+                    return list;
+                }
+            }
+
+            //Otherwise carve a new chunk into blocks and thread them into a list
+            char* chunk = static_cast<char*>(::operator new(Size * blocks_per_chunk));
+            for (size_t i = 0; i + 1 < blocks_per_chunk; i++) {
+                reinterpret_cast<FreeBlock*>(chunk + i*Size)->next = reinterpret_cast<FreeBlock*>(chunk + (i+1)*Size);
+            }
+            reinterpret_cast<FreeBlock*>(chunk + (blocks_per_chunk-1)*Size)->next = nullptr;
+            return reinterpret_cast<FreeBlock*>(chunk);
+        }
+
+    public:
+
+        static_assert(Size >= sizeof(FreeBlock) && Size % alignof(max_align_t) == 0,
+                      "NodePool size classes must be a multiple of the maximum alignment");
+
+        static void* allocate() {
+            //a NodePoolGiveBack thread doesn't keep a free list to allocate from (and its last pointer must
+            //stay the end of the list)
+            if (local_dead() || NodePoolGiveBack::enabled()) {
+                return ::operator new(Size);
+            }
+            Local& l = local();
+            if (!l.free_list) {
+                l.free_list = refill();
+            }
+            FreeBlock* b = l.free_list;
+            l.free_list = b->next;
+            return b;
+        }
+
+        static void deallocate(void* ptr) {
+            FreeBlock* b = static_cast<FreeBlock*>(ptr);
+            if (local_dead()) {
+                push_global(b, b);
+                return;
+            }
+            Local& l = local();
+            if (NodePoolGiveBack::enabled()) {
+                if (!l.free_list) {
+                    l.last = b;
+                    l.count = 0;
+                }
+                //(last is nil if the flag was set while the list already held blocks)
+                if (l.last && ++l.count > blocks_per_chunk) {
+                    b->next = l.free_list;
+                    push_global(b, l.last);
+                    l.free_list = nullptr;
+                    return;
+                }
+            }
+            b->next = l.free_list;
+            l.free_list = b;
+        }
+};
+
+//PoolAllocator is a standard allocator on top of NodePool that can be passed as the Alloc parameter of
+//PersistTreap.  The value_type doesn't matter, since PersistTreap rebinds it to whatever it allocates
+//(with the default shared_ptr nodes, that is the node and its control block together in one block).
+//Sizes are rounded up to the maximum alignment, so types of similar size share a pool.
+//It is stateless: every PoolAllocator compares equal, so memory from one can be freed by any other.
+
+template <typename T>
+struct PoolAllocator {
+    typedef T value_type;
+
+    PoolAllocator() {}
+    template <typename U> PoolAllocator(const PoolAllocator<U>&) {}
+
+    static const size_t size_class = (sizeof(T) + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+
+    T* allocate(size_t n) {
+        if (n != 1 || alignof(T) > alignof(max_align_t)) {
+            //only single objects come from the pool
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(NodePool<size_class>::allocate());
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        if (n != 1 || alignof(T) > alignof(max_align_t)) {
+            ::operator delete(ptr);
+            return;
+        }
+        NodePool<size_class>::deallocate(ptr);
+    }
+
+    template <typename U> bool operator==(const PoolAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Statistics
+//------------------------------------------------------------------------------------------------------------
+
+//Compiling with PERSIST_TREAP_STATS=1 counts what the engines do, to see where the time of an operation
+//goes.  For each kind of operation there are counters for the calls, the nodes cloned, the nodes reused in
+//place by transient updates (see PersistTreap's Transient updates), the steps taken (nodes visited on the
+//way down for split, join, and the point operations; recursive calls for the set operations) with the
+//maximum in one call, the reference count changes made by the node links (copies and releases; a moved
+//link changes no count), and the nodes and bytes allocated.
+//
+//Work is charged to the innermost operation running on the thread, so the splits and joins done by a union
+//are counted under SPLIT and JOIN, not UNION.  Work outside all of them, like from_sorted, counts as OTHER.
+//
+//Each thread writes only its own counters, so counting needs no atomic read-modify-writes.  The counters of
+//a thread are registered on its first use and kept after it exits, so snapshot() from any thread sums every
+//thread's work.  Without PERSIST_TREAP_STATS every hook is an empty inline function behind a constant false
+//and compiles away.
+
+#ifndef PERSIST_TREAP_STATS
+#define PERSIST_TREAP_STATS 0
+#endif
+
+struct TreapStats {
+    static const bool enabled = PERSIST_TREAP_STATS != 0;
+
+    enum Op { OTHER, SPLIT, JOIN, UNION, INTERSECT, DIFFERENCE, INSERT, ERASE, UPDATE, NUM_OPS };
+
+    struct OpStats {
+        uint64_t calls;
+        uint64_t clones;
+        uint64_t reused;
+        uint64_t steps;
+        uint64_t max_steps;
+        uint64_t refcount_ops;
+        uint64_t nodes_allocated;
+        uint64_t bytes_allocated;
+
+        double average_steps() const {
+            return calls ? double(steps) / calls : 0;
+        }
+    };
+
+    static const char* op_name(int op) {
+        static const char* names[NUM_OPS] = {"other", "split", "join", "union", "intersection", "difference",
+                                             "insert", "erase", "update"};
+        return names[op];
+    }
+
+    //Sums the counters of every thread.  The other threads' counters are read while they may be changing,
+    //so a snapshot taken while operations run is only approximately consistent.
+    static array<OpStats, NUM_OPS> snapshot() {
+        array<OpStats, NUM_OPS> result;
+        memset(result.data(), 0, sizeof(OpStats) * NUM_OPS);
+        lock_guard<mutex> lock(registry_mutex());
+        for (ThreadCounters* t : registry()) {
+            for (int op = 0; op < NUM_OPS; op++) {
+                OpStats& r = result[op];
+                const atomic<uint64_t>* c = t->c[op];
+                r.calls += c[CALLS].load(memory_order_relaxed);
+                r.clones += c[CLONES].load(memory_order_relaxed);
+                r.reused += c[REUSED].load(memory_order_relaxed);
+                r.steps += c[STEPS].load(memory_order_relaxed);
+                r.max_steps = max(r.max_steps, uint64_t(c[MAX_STEPS].load(memory_order_relaxed)));
+                r.refcount_ops += c[REFCOUNT_OPS].load(memory_order_relaxed);
+                r.nodes_allocated += c[NODES].load(memory_order_relaxed);
+                r.bytes_allocated += c[BYTES].load(memory_order_relaxed);
+            }
+        }
+        return result;
+    }
+
+    //Zeroes every thread's counters.  Only call it while no operations are running, since a thread in the
+    //middle of counting may write back an old value.
+    static void reset() {
+        lock_guard<mutex> lock(registry_mutex());
+        for (ThreadCounters* t : registry()) {
+            for (int op = 0; op < NUM_OPS; op++) {
+                for (int f = 0; f < NUM_FIELDS; f++) {
+                    t->c[op][f].store(0, memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    //Prints a snapshot as a table
+    static void print(ostream& out) {
+        array<OpStats, NUM_OPS> s = snapshot();
+        out << left << setw(14) << "operation" << right << setw(12) << "calls" << setw(12) << "clones"
+            << setw(12) << "reused" << setw(10) << "avg steps" << setw(10) << "max steps" << setw(14) << "refcount ops"
+            << setw(14) << "bytes" << endl;
+        for (int op = 0; op < NUM_OPS; op++) {
+            out << left << setw(14) << op_name(op) << right << setw(12) << s[op].calls << setw(12) << s[op].clones
+                << setw(12) << s[op].reused << setw(10) << fixed << setprecision(1) << s[op].average_steps()
+                << setw(10) << s[op].max_steps << setw(14) << s[op].refcount_ops << setw(14)
+                << s[op].bytes_allocated << endl;
+        }
+    }
+
+    //The hooks called by the engines
+
+    static void clone() {
+        add(CLONES, 1);
+    }
+
+    static void reused() {
+        add(REUSED, 1);
+    }
+
+    static void step() {
+        add(STEPS, 1);
+    }
+
+    static void refcount_op() {
+        add(REFCOUNT_OPS, 1);
+    }
+
+    static void allocated(size_t bytes) {
+        add(NODES, 1);
+        add(BYTES, bytes);
+    }
+
+    //Charges the work done while it is alive to op, and counts a call with its steps
+    class Scope {
+        public:
+            explicit Scope(Op op) {
+                if (enabled) {
+                    previous = current();
+                    current() = op;
+                    add(CALLS, 1);
+                    start = counters().c[op][STEPS].load(memory_order_relaxed);
+                }
+            }
+
+            ~Scope() {
+                if (enabled) {
+                    atomic<uint64_t>* c = counters().c[current()];
+                    uint64_t steps = c[STEPS].load(memory_order_relaxed) - start;
+                    if (steps > c[MAX_STEPS].load(memory_order_relaxed)) {
+                        c[MAX_STEPS].store(steps, memory_order_relaxed);
+                    }
+                    current() = previous;
+                }
+            }
+
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+
+        private:
+            int previous;
+            uint64_t start;
+    };
+
+    private:
+
+        enum Field { CALLS, CLONES, REUSED, STEPS, MAX_STEPS, REFCOUNT_OPS, NODES, BYTES, NUM_FIELDS };
+
+        struct ThreadCounters {
+            atomic<uint64_t> c[NUM_OPS][NUM_FIELDS];
+
+            ThreadCounters() {
+                for (int op = 0; op < NUM_OPS; op++) {
+                    for (int f = 0; f < NUM_FIELDS; f++) {
+                        c[op][f].store(0, memory_order_relaxed);
+                    }
+                }
+            }
+        };
+
+        static mutex& registry_mutex() {
+            static mutex m;
+            return m;
+        }
+
+        //never destroyed, so the counters stay reachable until the very end of the process
+        static vector<ThreadCounters*>& registry() {
+            static vector<ThreadCounters*>* r = new vector<ThreadCounters*>();
+            return *r;
+        }
+
+        //The counters of the calling thread, registered on first use and never freed so that snapshot still
+        //sees them after the thread exits
+        static ThreadCounters& counters() {
+            static thread_local ThreadCounters* mine = nullptr;
+            if (!mine) {
+                mine = new ThreadCounters();
+                lock_guard<mutex> lock(registry_mutex());
+                registry().push_back(mine);
+            }
+            return *mine;
+        }
+
+        static int& current() {
+            static thread_local int op = OTHER;
+            return op;
+        }
+
+        static void add(Field f, uint64_t n) {
+            if (enabled) {
+                atomic<uint64_t>& c = counters().c[current()][f];
+                //only this thread writes its counters
+                c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+            }
+        }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Node reference counting
+//------------------------------------------------------------------------------------------------------------
+
+//The RefPolicy parameter of PersistTreap decides how nodes are reference counted.  A policy provides
+//  - Hook, a base class of Node holding whatever the policy stores inside each node
+//  - ptr<T, A>, the pointer type used for the node links, where A is the allocator to free nodes with
+//  - make<T>(A), which allocates a new T
+//  - thread_safe, which says whether versions may be shared between threads
+//  - node_overhead, the bytes allocated per node on top of the Node itself (for memory accounting)
+//  - unique(p), which says whether p holds the only reference to its node (for transient updates)
+
+//shared_ptr keeps its counts to itself, so in stats builds SharedRef's links are this subclass, which
+//counts the copies and releases the same way IntrusivePtr does.
+template <typename T>
+struct CountedSharedPtr : shared_ptr<T> {
+    CountedSharedPtr() {}
+    CountedSharedPtr(nullptr_t) {}
+    CountedSharedPtr(shared_ptr<T>&& p) noexcept : shared_ptr<T>(move(p)) {}
+
+    CountedSharedPtr(const CountedSharedPtr& o) : shared_ptr<T>(o) {
+        if (o) {
+            TreapStats::refcount_op();
+        }
+    }
+
+    CountedSharedPtr(CountedSharedPtr&& o) noexcept : shared_ptr<T>(move(o)) {}
+
+    ~CountedSharedPtr() {
+        if (*this) {
+            TreapStats::refcount_op();
+        }
+    }
+
+    CountedSharedPtr& operator=(const CountedSharedPtr& o) {
+        CountedSharedPtr keep(o);
+        shared_ptr<T>::swap(keep);
+        return *this;
+    }
+
+    CountedSharedPtr& operator=(CountedSharedPtr&& o) noexcept {
+        CountedSharedPtr keep(move(o));
+        shared_ptr<T>::swap(keep);
+        return *this;
+    }
+
+    CountedSharedPtr& operator=(nullptr_t) {
+        reset();
+        return *this;
+    }
+
+    void reset() {
+        CountedSharedPtr().shared_ptr<T>::swap(*this);
+    }
+};
+
+//SharedRef is the default and just uses shared_ptr.  The control block is allocated alongside the node.
+struct SharedRef {
+    static const bool thread_safe = true;
+    //the control block's vtable pointer and two counts
+    static const size_t node_overhead = 16;
+
+    struct Hook {};
+
+    template <typename T, typename A>
+    using ptr = typename conditional<TreapStats::enabled, CountedSharedPtr<T>, shared_ptr<T>>::type;
+
+    template <typename T, typename A> static shared_ptr<T> make(const A& a) {
+        return allocate_shared<T>(a);
+    }
+
+    template <typename T> static bool unique(const shared_ptr<T>& p) {
+        //use_count is a relaxed load, so the fence is what makes the last reads of the node by the thread
+        //that dropped the other reference happen before this thread changes it
+        if (p.use_count() == 1) {
+            atomic_thread_fence(memory_order_acquire);
+            return true;
+        }
+        return false;
+    }
+};
+
+//IntrusivePtr is a pointer to a node which holds its own reference count, like boost::intrusive_ptr.
+//Compared to shared_ptr the pointer is 8 bytes instead of 16, there is no control block, and when
+//Atomic is false copying a pointer is a plain increment.
+template <typename T, typename A, bool Atomic>
+struct IntrusivePtr {
+    private:
+        T* ptr;
+
+        void acquire() const {
+            if (ptr) {
+                TreapStats::refcount_op();
+                if (Atomic) {
+                    ptr->refs.fetch_add(1, memory_order_relaxed);
+                } else {
+                    ptr->refs.store(ptr->refs.load(memory_order_relaxed) + 1, memory_order_relaxed);
+                }
+            }
+        }
+
+        void release() {
+            if (!ptr) {
+                return;
+            }
+            TreapStats::refcount_op();
+            unsigned remaining;
+            if (Atomic) {
+                remaining = ptr->refs.fetch_sub(1, memory_order_acq_rel) - 1;
+            } else {
+                remaining = ptr->refs.load(memory_order_relaxed) - 1;
+                ptr->refs.store(remaining, memory_order_relaxed);
+            }
+            if (remaining == 0) {
+                typedef typename allocator_traits<A>::template rebind_alloc<T> TAlloc;
+                TAlloc a;
+                allocator_traits<TAlloc>::destroy(a, ptr);
+                allocator_traits<TAlloc>::deallocate(a, ptr, 1);
+            }
+        }
+
+    public:
+        IntrusivePtr() : ptr(nullptr) {}
+        IntrusivePtr(nullptr_t) : ptr(nullptr) {}
+
+        //Adopts a raw pointer, incrementing its count
+        explicit IntrusivePtr(T* p) : ptr(p) { acquire(); }
+
+        IntrusivePtr(const IntrusivePtr& o) : ptr(o.ptr) { acquire(); }
+        IntrusivePtr(IntrusivePtr&& o) noexcept : ptr(o.ptr) { o.ptr = nullptr; }
+        ~IntrusivePtr() { release(); }
+
+        IntrusivePtr& operator=(const IntrusivePtr& o) {
+            //Copy o.ptr out and acquire it before releasing.  o may live inside the node being released
+            //(as in v = v->left), in which case o is destroyed by release().
+            IntrusivePtr keep(o);
+            swap(ptr, keep.ptr);
+            return *this;
+        }
+
+        IntrusivePtr& operator=(IntrusivePtr&& o) noexcept {
+            //same as above, o may be destroyed by releasing the current node
+            IntrusivePtr keep(move(o));
+            swap(ptr, keep.ptr);
+            return *this;
+        }
+
+        IntrusivePtr& operator=(nullptr_t) {
+            reset();
+            return *this;
+        }
+
+        void reset() {
+            release();
+            ptr = nullptr;
+        }
+
+        T* get() const { return ptr; }
+        T* operator->() const { return ptr; }
+        T& operator*() const { return *ptr; }
+        explicit operator bool() const { return ptr != nullptr; }
+
+        long use_count() const { return ptr ? ptr->refs.load(memory_order_relaxed) : 0; }
+
+        //True if this is the only reference, with an acquire load for the same reason as SharedRef::unique
+        bool unique() const { return ptr && ptr->refs.load(memory_order_acquire) == 1; }
+
+        bool operator==(const IntrusivePtr& o) const { return ptr == o.ptr; }
+        bool operator!=(const IntrusivePtr& o) const { return ptr != o.ptr; }
+        bool operator==(nullptr_t) const { return ptr == nullptr; }
+        bool operator!=(nullptr_t) const { return ptr != nullptr; }
+};
+
+//IntrusiveRef stores the count inside the node.  IntrusiveRef<true> uses an atomic count so versions can
+//be handed between threads; IntrusiveRef<false> is for single-threaded use and has no atomic operations.
+//(The non-atomic count still uses atomic<unsigned> with relaxed loads and stores, which compile to plain
+//moves, so that a single IntrusivePtr implementation works for both.)
+template <bool Atomic>
+struct IntrusiveRef {
+    static const bool thread_safe = Atomic;
+    static const size_t node_overhead = 0;
+
+    struct Hook {
+        mutable atomic<unsigned> refs;
+
+        Hook() : refs(0) {}
+        //a copied node starts with its own count, not the count of the node it was copied from
+        Hook(const Hook&) : refs(0) {}
+        Hook& operator=(const Hook&) { return *this; }
+    };
+
+    template <typename T, typename A> using ptr = IntrusivePtr<T, A, Atomic>;
+
+    template <typename T, typename A> static IntrusivePtr<T, A, Atomic> make(const A& a) {
+        typedef typename allocator_traits<A>::template rebind_alloc<T> TAlloc;
+        TAlloc ta(a);
+        T* raw = allocator_traits<TAlloc>::allocate(ta, 1);
+        try {
+            allocator_traits<TAlloc>::construct(ta, raw);
+        } catch (...) {
+            allocator_traits<TAlloc>::deallocate(ta, raw, 1);
+            throw;
+        }
+        return IntrusivePtr<T, A, Atomic>(raw);
+    }
+
+    template <typename T, typename A> static bool unique(const IntrusivePtr<T, A, Atomic>& p) {
+        return p.unique();
+    }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Node reclamation
+//------------------------------------------------------------------------------------------------------------
+
+//When the last reference to a node goes away, the node's destructor drops its children, which frees them too
+//if nothing else holds them.  So dropping the last version that holds a big subtree frees the whole subtree
+//right there, recursively: the thread stalls for as long as freeing every node takes, and on a degenerate
+//treap (built with constant priorities, say) the recursion is as deep as the treap and overflows the stack.
+//
+//Instead the destructor of a node hands its children to NodeReclaimer.  The children the node was the last
+//owner of go onto a per-thread list of pending subtrees, which is freed a node at a time in a loop, so
+//destruction never nests more than one level.  How much is freed right away is set by Reclaimer::set_mode,
+//for all treaps at once:
+//  - IMMEDIATE, the default, frees everything before returning, like the recursive destructor did
+//  - DEFERRED frees at most budget nodes; the rest stays on the thread's list, and later frees on the same
+//    thread each free another budget nodes of it
+//  - BACKGROUND frees at most budget nodes, then hands whatever is left to a background thread.  This needs a
+//    thread-safe RefPolicy; with IntrusiveRef<false> it works like DEFERRED.
+//In DEFERRED and BACKGROUND mode the work a writer does to drop a version is bounded however big the version
+//is.  In DEFERRED mode the memory only comes back as fast as the thread keeps freeing nodes, so a thread that
+//drops a big version and then stops updating should call flush().  A thread frees what it still has pending
+//when it exits.  Nodes freed after that (by static treaps at exit) are freed recursively.
+
+struct Reclaimer {
+    enum Mode { IMMEDIATE, DEFERRED, BACKGROUND };
+
+    //the most nodes a single release frees on the calling thread in DEFERRED and BACKGROUND mode, which is
+    //more than the path an update on a big treap drops, so that stays on the calling thread
+    static const size_t budget = 64;
+
+    static void set_mode(Mode m) {
+        mode_ref().store(m, memory_order_relaxed);
+    }
+
+    static Mode mode() {
+        return mode_ref().load(memory_order_relaxed);
+    }
+
+    //Frees everything pending on this thread, then waits until the background thread has freed everything
+    //handed to it so far.
+    static void flush() {
+        for (List* l = lists(); l; l = l->next) {
+            l->drain_all();
+        }
+        if (started().load(memory_order_acquire) && !closed().load(memory_order_acquire)) {
+            instance().wait_idle();
+        }
+    }
+
+    //The pending list of one node type on one thread (see NodeReclaimer).  The lists of a thread are linked
+    //together so flush can find them.
+    struct List {
+        List* next;
+
+        List() : next(lists()) {
+            lists() = this;
+        }
+
+        virtual ~List() {
+            for (List** l = &lists(); *l; l = &(*l)->next) {
+                if (*l == this) {
+                    *l = next;
+                    break;
+                }
+            }
+        }
+
+        virtual void drain_all() = 0;
+    };
+
+    //Subtrees handed to the background thread, which calls run() to free them
+    struct Batch {
+        virtual ~Batch() {}
+        virtual void run() = 0;
+    };
+
+    //Queues b for the background thread and empties b, starting the thread the first time.  Returns false and
+    //leaves b alone if that fails (or the thread is already gone, at exit).
+    static bool hand_over(unique_ptr<Batch>& b) noexcept {
+        if (closed().load(memory_order_acquire)) {
+            return false;
+        }
+        try {
+            Reclaimer& r = instance();
+            {
+                lock_guard<mutex> guard(r.lock);
+                r.queue.push_back(move(b));
+            }
+            r.cv.notify_one();
+            return true;
+        } catch (...) {
+            return false;
+        }
+    }
+
+    private:
+        mutex lock;
+        condition_variable cv;
+        condition_variable idle;
+        deque<unique_ptr<Batch>> queue;
+        bool busy = false;
+        bool stopping = false;
+        thread worker;
+
+        //these are trivially destructible, so they can still be read at exit after instance() is destroyed
+        static atomic<Mode>& mode_ref() {
+            static atomic<Mode> m(IMMEDIATE);
+            return m;
+        }
+
+        static atomic<bool>& started() {
+            static atomic<bool> s(false);
+            return s;
+        }
+
+        static atomic<bool>& closed() {
+            static atomic<bool> c(false);
+            return c;
+        }
+
+        static List*& lists() {
+            static thread_local List* head = nullptr;
+            return head;
+        }
+
+        static Reclaimer& instance() {
+            static Reclaimer r;
+            started().store(true, memory_order_release);
+            return r;
+        }
+
+        Reclaimer() : worker([this] { worker_loop(); }) {}
+
+        //frees everything still queued before the thread stops
+        ~Reclaimer() {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            closed().store(true, memory_order_release);
+            cv.notify_all();
+            worker.join();
+        }
+
+        void wait_idle() {
+            unique_lock<mutex> guard(lock);
+            idle.wait(guard, [this] { return queue.empty() && !busy; });
+        }
+
+        void worker_loop() {
+            NodePoolGiveBack::enabled() = true;
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                cv.wait(guard, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                unique_ptr<Batch> b = move(queue.front());
+                queue.pop_front();
+                busy = true;
+                guard.unlock();
+                b->run();
+                b.reset();
+                guard.lock();
+                busy = false;
+                if (queue.empty()) {
+                    idle.notify_all();
+                }
+            }
+        }
+};
+
+//The destructor of every node calls NodeReclaimer<NodePtr, RefPolicy>::release on its children.
+template <typename NodePtr, typename RefPolicy>
+struct NodeReclaimer {
+    static void release(NodePtr& left, NodePtr& right) noexcept {
+        if (!left && !right) {
+            return;
+        }
+        State* s = state();
+        if (!s) {
+            //the thread's list is already gone, so the children are dropped by the node's destructor
+            return;
+        }
+        s->take(left);
+        s->take(right);
+        //if this node is being freed by drain, the loop there picks up the children
+        if (s->draining || s->pending.empty()) {
+            return;
+        }
+        Reclaimer::Mode m = Reclaimer::mode();
+        if (m == Reclaimer::IMMEDIATE) {
+            s->drain(SIZE_MAX);
+            return;
+        }
+        s->drain(Reclaimer::budget);
+        if (m == Reclaimer::BACKGROUND && RefPolicy::thread_safe && !s->pending.empty()) {
+            s->hand_over();
+        }
+    }
+
+    private:
+        enum Phase { NEVER, ALIVE, GONE };
+
+        //trivially destructible, so it can be read after the State of the thread is destroyed
+        static Phase& phase() {
+            static thread_local Phase p = NEVER;
+            return p;
+        }
+
+        struct State : Reclaimer::List {
+            vector<NodePtr> pending;
+            bool draining = false;
+
+            State() {
+                phase() = ALIVE;
+            }
+
+            ~State() {
+                drain(SIZE_MAX);
+                phase() = GONE;
+            }
+
+            void drain_all() override {
+                drain(SIZE_MAX);
+            }
+
+            //Moves child onto the list if the dying node holds the only reference to it.  A shared child is
+            //just dropped by the node's destructor, which doesn't free it.  If the list can't grow the child
+            //stays where it is and is freed recursively.
+            void take(NodePtr& child) {
+                if (child && RefPolicy::unique(child)) {
+                    try {
+                        pending.push_back(move(child));
+                    } catch (...) {
+                    }
+                }
+            }
+
+            //Frees up to limit nodes.  Freeing a node calls release on its children, which only puts them
+            //on the list while draining is set.
+            void drain(size_t limit) {
+                bool was_draining = draining;
+                draining = true;
+                for (size_t i = 0; i < limit && !pending.empty(); i++) {
+                    NodePtr v = move(pending.back());
+                    pending.pop_back();
+                }
+                draining = was_draining;
+            }
+
+            void hand_over() {
+                try {
+                    unique_ptr<Reclaimer::Batch> b(new Batch);
+                    static_cast<Batch&>(*b).nodes.swap(pending);
+                    if (!Reclaimer::hand_over(b)) {
+                        pending.swap(static_cast<Batch&>(*b).nodes);
+                    }
+                } catch (...) {
+                }
+            }
+        };
+
+        struct Batch : Reclaimer::Batch {
+            vector<NodePtr> nodes;
+
+            //runs on the background thread, whose own list is always empty between batches
+            void run() override {
+                if (State* s = state()) {
+                    s->pending.swap(nodes);
+                    s->drain(SIZE_MAX);
+                }
+            }
+        };
+
+        static State* state() {
+            if (phase() == GONE) {
+                return nullptr;
+            }
+            static thread_local State s;
+            return &s;
+        }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Fork-join pool
+//------------------------------------------------------------------------------------------------------------
+
+//The set operations make two independent recursive calls on the split halves, so the calls can run in
+//parallel.  ForkJoinPool is a small work-stealing pool for that: fork() queues a task, and join() waits for
+//it.  Each thread has its own deque of the tasks it forked.  It works from the back of it, so it first runs
+//the task it forked last, the smallest one and the one whose nodes it just touched.  Only when its own deque
+//is empty does it steal, from the front of another thread's deque: the oldest task there, the biggest piece
+//of work (closest to the root), so one steal hands over a lot of work.  A thread waiting in join() runs tasks
+//until its own task is done, and sleeps when there is nothing to run, until a task finishes or a new one is
+//forked.
+
+struct ForkJoinPool {
+    struct Task {
+        function<void()> fn;
+        atomic<bool> done;
+        exception_ptr error;
+
+        explicit Task(function<void()> f) : fn(move(f)), done(false) {}
+    };
+
+    static ForkJoinPool& instance() {
+        static ForkJoinPool pool;
+        return pool;
+    }
+
+    //the number of threads working on tasks, including the thread that calls join
+    unsigned threads() const {
+        return workers.size() + 1;
+    }
+
+    void fork(Task& t) {
+        WorkQueue& q = queues[my_queue()];
+        {
+            lock_guard<mutex> guard(q.lock);
+            q.tasks.push_back(&t);
+        }
+        queued.fetch_add(1);
+        wake(false);
+    }
+
+    void join(Task& t) {
+        size_t me = my_queue();
+        while (!t.done.load()) {
+            Task* other = take(me);
+            if (other) {
+                run(other);
+                continue;
+            }
+            //t is running on another thread, and there's nothing to help with
+            unique_lock<mutex> guard(lock);
+            sleepers++;
+            cv.wait(guard, [&] { return t.done.load() || queued.load() > 0; });
+            sleepers--;
+        }
+        if (t.error) {
+            rethrow_exception(t.error);
+        }
+    }
+
+    private:
+        //One thread's tasks.  The owner pushes and pops at the back and thieves take from the front, each
+        //under the queue's own lock, so threads only contend when they go for the same queue.
+        struct alignas(64) WorkQueue {
+            mutex lock;
+            deque<Task*> tasks;
+            atomic<bool> owned{false};
+        };
+
+        //A thread claims a free queue the first time it forks or works, and gives it back when it exits.  If
+        //more than max_queues threads use the pool at once the extra ones share queues, which only costs
+        //them some locality: any thread may run any task.
+        static const size_t max_queues = 128;
+
+        struct QueueSlot {
+            ForkJoinPool* pool = nullptr;
+            size_t index = 0;
+
+            ~QueueSlot() {
+                if (pool) {
+                    pool->queues[index].owned.store(false);
+                }
+            }
+        };
+
+        WorkQueue queues[max_queues];
+        //one past the highest queue ever claimed, so thieves don't look at the rest
+        atomic<size_t> used{0};
+        //the number of tasks in all the queues, so a thread can tell there's nothing to steal without
+        //locking every queue
+        atomic<size_t> queued{0};
+        //the threads asleep on cv, so run and fork can skip the lock when nobody waits
+        atomic<int> sleepers{0};
+
+        mutex lock;
+        condition_variable cv;
+        vector<thread> workers;
+        bool stopping = false;
+
+        ForkJoinPool() {
+            unsigned n = thread::hardware_concurrency();
+            for (unsigned i = 1; i < n; i++) {
+                workers.emplace_back([this] { worker_loop(); });
+            }
+        }
+
+        ~ForkJoinPool() {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            cv.notify_all();
+            for (thread& w : workers) {
+                w.join();
+            }
+        }
+
+        size_t my_queue() {
+            thread_local QueueSlot slot;
+            if (slot.pool == this) {
+                return slot.index;
+            }
+            for (size_t i = 0; i < max_queues; i++) {
+                bool expected = false;
+                if (queues[i].owned.compare_exchange_strong(expected, true)) {
+                    size_t seen = used.load();
+                    while (seen < i + 1 && !used.compare_exchange_weak(seen, i + 1)) {
+                    }
+                    slot.pool = this;
+                    slot.index = i;
+                    return i;
+                }
+            }
+            return hash<thread::id>()(this_thread::get_id()) % max_queues;
+        }
+
+        //Pops the newest task off this thread's queue or, failing that, steals the oldest task of another
+        Task* take(size_t me) {
+            if (queued.load() == 0) {
+                return nullptr;
+            }
+            Task* t = nullptr;
+            {
+                WorkQueue& q = queues[me];
+                lock_guard<mutex> guard(q.lock);
+                if (!q.tasks.empty()) {
+                    t = q.tasks.back();
+                    q.tasks.pop_back();
+                }
+            }
+            size_t n = max(used.load(), me + 1);
+            for (size_t i = 1; !t && i < n; i++) {
+                WorkQueue& q = queues[(me + i) % n];
+                lock_guard<mutex> guard(q.lock);
+                if (!q.tasks.empty()) {
+                    t = q.tasks.front();
+                    q.tasks.pop_front();
+                }
+            }
+            if (t) {
+                queued.fetch_sub(1);
+            }
+            return t;
+        }
+
+        //A sleeper increments sleepers and then checks its condition, and the waker changes the condition
+        //and then checks sleepers, all sequentially consistent, so either the sleeper sees the change or
+        //the waker sees the sleeper and notifies it under the lock.
+        void wake(bool all) {
+            if (sleepers.load() > 0) {
+                lock_guard<mutex> guard(lock);
+                if (all) {
+                    cv.notify_all();
+                } else {
+                    cv.notify_one();
+                }
+            }
+        }
+
+        void run(Task* t) {
+            try {
+                t->fn();
+            } catch (...) {
+                t->error = current_exception();
+            }
+            //the joiner may return and destroy t as soon as done is set, so t isn't touched after this
+            t->done.store(true);
+            wake(true);
+        }
+
+        void worker_loop() {
+            size_t me = my_queue();
+            while (true) {
+                Task* t = take(me);
+                if (t) {
+                    run(t);
+                    continue;
+                }
+                unique_lock<mutex> guard(lock);
+                sleepers++;
+                cv.wait(guard, [this] { return stopping || queued.load() > 0; });
+                sleepers--;
+                if (stopping && queued.load() == 0) {
+                    return;
+                }
+            }
+        }
+};
+
+//Pass Parallel() as the last argument of treap_union, intersection, or difference to run them on the
+//ForkJoinPool.  Only the top spawn_depth levels of the recursion fork tasks; below that each task runs the
+//normal sequential helpers.  The default depth gives around 8 tasks per thread, enough to even out the
+//uneven split sizes.  This is only worth it for large treaps (tens of thousands of nodes and up).
+//If the treap has subtree sizes (SizeAugment), pieces of work with fewer than grain nodes in total also
+//run sequentially.
+struct Parallel {
+    int spawn_depth;
+    size_t grain;
+
+    Parallel() : grain(4096) {
+        spawn_depth = 3;
+        for (unsigned t = ForkJoinPool::instance().threads(); t > 1; t /= 2) {
+            spawn_depth++;
+        }
+    }
+
+    explicit Parallel(int depth, size_t g = 4096) : spawn_depth(depth), grain(g) {}
+};
+
+//A merge sort on the ForkJoinPool: the two halves are sorted in parallel for the first depth levels, then
+//with stable_sort, and merged with inplace_merge.  Like stable_sort, equal elements keep their order.
+template <typename It, typename Compare>
+void parallel_stable_sort(It first, It last, Compare comp, int depth) {
+    if (depth <= 0 || last - first < 8192) {
+        stable_sort(first, last, comp);
+        return;
+    }
+    It mid = first + (last - first) / 2;
+    ForkJoinPool& pool = ForkJoinPool::instance();
+    ForkJoinPool::Task task([&] { parallel_stable_sort(first, mid, comp, depth - 1); });
+    pool.fork(task);
+    try {
+        parallel_stable_sort(mid, last, comp, depth - 1);
+    } catch (...) {
+        try {
+            pool.join(task);
+        } catch (...) {
+        }
+        throw;
+    }
+    pool.join(task);
+    inplace_merge(first, mid, last, comp);
+}
+
+//------------------------------------------------------------------------------------------------------------
+// Augmentation
+//------------------------------------------------------------------------------------------------------------
+
+//The Augment parameter of PersistTreap stores extra data in every node that is computed from the node
+//and its children, like the size of the subtree.  Nodes are never changed once they are part of a
+//treap, so the data only has to be computed for the new nodes that split/join/union create, right after
+//their children are set.  An Augment policy provides
+//  - Data, a base class of Node holding the extra fields
+//  - pull(w), which recomputes the fields of w from w and its children w.left and w.right (either may be nil)
+//  - enabled, which is false only for NoAugment so the bookkeeping can be skipped
+//  - has_size, which says if Node has a size field (enabling size, rank, select, and count_range)
+//  - has_aggregate, which says if Node has an agg field (enabling aggregate), and if so a typedef monoid
+//  - has_hash, which says if Node has a Merkle hash field (used by operator== and HashCons)
+//  - has_lazy, which says if Node has a lazy field of pending updates (see LazyUpdate), and tag, the policy
+//    of those updates (NoTag for everything but LazyUpdate)
+
+//The tag of the policies without LazyUpdate: nothing is ever pending.
+struct NoTag {
+    struct type {};
+    static type identity() { return type(); }
+    static bool is_identity(const type&) { return true; }
+    template <typename V> static void apply(const type&, V&) {}
+    static type compose(const type&, const type&) { return type(); }
+};
+
+struct NoAugment {
+    static const bool enabled = false;
+    static const bool has_size = false;
+    static const bool has_aggregate = false;
+    static const bool has_hash = false;
+    static const bool has_lazy = false;
+    typedef NoTag tag;
+
+    struct Data {};
+
+    template <typename N> static void pull(N&) {}
+};
+
+//SizeAugment stores the number of nodes in each subtree, for O(log n) order statistics.
+struct SizeAugment {
+    static const bool enabled = true;
+    static const bool has_size = true;
+    static const bool has_aggregate = false;
+    static const bool has_hash = false;
+    static const bool has_lazy = false;
+    typedef NoTag tag;
+
+    struct Data {
+        size_t size;
+    };
+
+    template <typename N> static void pull(N& w) {
+        w.size = 1 + (w.left ? w.left->size : 0) + (w.right ? w.right->size : 0);
+    }
+};
+
+//Aggregate caches the combination of all elements in each subtree under a user supplied monoid, so that
+//aggregate(lo, hi) can combine the elements in a key range in O(log n).  A monoid provides
+//  - type, the type of the aggregated values
+//  - identity(), the value of an empty range
+//  - lift(key, val), the value of a single element
+//  - combine(a, b), an associative function where a covers smaller keys than b
+//For example, SumMonoid<int> below sums the values.
+
+template <typename Monoid>
+struct Aggregate {
+    static const bool enabled = true;
+    static const bool has_size = false;
+    static const bool has_aggregate = true;
+    static const bool has_hash = false;
+    static const bool has_lazy = false;
+    typedef NoTag tag;
+    typedef Monoid monoid;
+
+    struct Data {
+        typename Monoid::type agg;
+    };
+
+    template <typename N> static void pull(N& w) {
+        typename Monoid::type a = Monoid::lift(w.key, w.val);
+        if (w.left) {
+            a = Monoid::combine(w.left->agg, a);
+        }
+        if (w.right) {
+            a = Monoid::combine(a, w.right->agg);
+        }
+        w.agg = a;
+    }
+};
+
+template <typename T>
+struct SumMonoid {
+    typedef T type;
+    static T identity() { return T(); }
+    template <typename K> static T lift(const K&, const T& val) { return val; }
+    static T combine(const T& a, const T& b) { return a + b; }
+};
+
+template <typename T>
+struct MinMonoid {
+    typedef T type;
+    static T identity() { return numeric_limits<T>::max(); }
+    template <typename K> static T lift(const K&, const T& val) { return val; }
+    static T combine(const T& a, const T& b) { return b < a ? b : a; }
+};
+
+template <typename T>
+struct MaxMonoid {
+    typedef T type;
+    static T identity() { return numeric_limits<T>::lowest(); }
+    template <typename K> static T lift(const K&, const T& val) { return val; }
+    static T combine(const T& a, const T& b) { return a < b ? b : a; }
+};
+
+//MerkleHash stores a hash of each subtree, computed from the key, value, and priority of the node and the
+//hashes of its children.  Two subtrees with different hashes are different, and subtrees with the same
+//hash are almost certainly identical (same elements, priorities, and shape), which is what the HashCons
+//table in PersistTreap uses to find identical subtrees.  Keys and values must work with std::hash.
+struct MerkleHash {
+    static const bool enabled = true;
+    static const bool has_size = false;
+    static const bool has_aggregate = false;
+    static const bool has_hash = true;
+    static const bool has_lazy = false;
+    typedef NoTag tag;
+
+    struct Data {
+        uint64_t hash;
+    };
+
+    static uint64_t mix(uint64_t a, uint64_t b) {
+        //the boost hash_combine step followed by the splitmix64 finalizer
+        uint64_t x = a ^ (b + 0x9e3779b97f4a7c15ULL + (a << 6) + (a >> 2));
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    template <typename N> static void pull(N& w) {
+        uint64_t h = hash<decltype(w.key)>()(w.key);
+        h = mix(h, hash<decltype(w.val)>()(w.val));
+        h = mix(h, w.p);
+        //an empty child hashes differently from any node
+        h = mix(h, w.left ? w.left->hash : 1);
+        h = mix(h, w.right ? w.right->hash : 2);
+        w.hash = h;
+    }
+};
+
+//LazyUpdate stores a pending update in each node, so that apply_range can change the values of a whole key
+//range in O(log n).  A Tag policy provides
+//  - type, the type of an update
+//  - identity(), the update that changes nothing, and is_identity(t)
+//  - apply(t, val), which changes val by t
+//  - compose(later, earlier), a single update that does earlier and then later
+//For example, AddTag<int> below adds to the values.
+//
+//A node's lazy field is an update still to be made to every value below it; its own value already has it.
+//Every engine that changes nodes gets the children of a node through unpack, which hands the update down
+//first: the children are replaced by copies with it applied to their values and composed into their lazy
+//fields.  So an update only moves down when an operation goes through that node anyway, and apply_range is
+//two splits, one tagged node, and two joins.
+//
+//The values stored below a node with a pending update are out of date, so the lookups that return
+//pointers into nodes (find, lower_bound, min, select, the iterators, ...) don't compile with LazyUpdate:
+//get, for_each, and for_each_range return values with the updates applied.  Snapshots, deltas, diff, and
+//operator== read the stored values too, and so do the Aggregate and MerkleHash augments, so none of them
+//can be combined with it.
+template <typename Tag>
+struct LazyUpdate {
+    //there is nothing to pull
+    static const bool enabled = false;
+    static const bool has_size = false;
+    static const bool has_aggregate = false;
+    static const bool has_hash = false;
+    static const bool has_lazy = true;
+    typedef Tag tag;
+
+    struct Data {
+        typename Tag::type lazy = Tag::identity();
+    };
+
+    template <typename N> static void pull(N&) {}
+};
+
+template <typename T>
+struct AddTag {
+    typedef T type;
+    static T identity() { return T(); }
+    static bool is_identity(const T& t) { return t == T(); }
+    template <typename V> static void apply(const T& t, V& val) { val += t; }
+    static T compose(const T& later, const T& earlier) { return earlier + later; }
+};
+
+//Finds the tag of the first policy in As that is a LazyUpdate, or NoTag if there isn't one.
+template <bool Found, typename A, typename... Rest> struct augment_tag {
+    typedef NoTag type;
+};
+template <typename A, typename... Rest> struct augment_tag<true, A, Rest...> {
+    typedef typename A::tag type;
+};
+template <typename A, typename B, typename... Rest> struct augment_tag<false, A, B, Rest...>
+    : augment_tag<B::has_lazy, B, Rest...> {};
+
+//Finds the monoid of the first policy in As that is an Aggregate, or void if there isn't one.
+template <bool Found, typename A, typename... Rest> struct augment_monoid {
+    typedef void type;
+};
+template <typename A, typename... Rest> struct augment_monoid<true, A, Rest...> {
+    typedef typename A::monoid type;
+};
+template <typename A, typename B, typename... Rest> struct augment_monoid<false, A, B, Rest...>
+    : augment_monoid<B::has_aggregate, B, Rest...> {};
+
+//Augments combines several policies, for example Augments<SizeAugment, Aggregate<SumMonoid<int>>>
+//to have both order statistics and range sums.  At most one of them can be an Aggregate.
+
+template <typename... As>
+struct Augments {
+    static const bool enabled = (As::enabled || ...);
+    static const bool has_size = (As::has_size || ...);
+    static const bool has_aggregate = (As::has_aggregate || ...);
+    static const bool has_hash = (As::has_hash || ...);
+    static const bool has_lazy = (As::has_lazy || ...);
+    static_assert((int(As::has_aggregate) + ... + 0) <= 1, "Augments can only contain one Aggregate");
+    static_assert((int(As::has_lazy) + ... + 0) <= 1, "Augments can only contain one LazyUpdate");
+
+    struct Data : As::Data... {};
+
+    template <typename N> static void pull(N& w) {
+        (As::pull(w), ...);
+    }
+
+    typedef typename augment_monoid<false, NoAugment, As...>::type monoid;
+    typedef typename augment_tag<false, NoAugment, As...>::type tag;
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Priorities
+//------------------------------------------------------------------------------------------------------------
+
+//The Priority parameter of PersistTreap chooses where node priorities come from.  A policy provides
+//priority(key), returning the priority of a new node with that key.  A smaller priority is closer to the
+//root.  Ties are broken by key, so the shape of a treap only depends on its keys and their priorities.
+//canonical says whether the priority only depends on the key, in which case two treaps with the same
+//elements have exactly the same shape.
+
+//The original behaviour: rand() has global state, isn't thread safe in every libc, and only returns
+//15 bits on some platforms, so it leads to lots of ties.
+struct RandPriority {
+    static const bool canonical = false;
+
+    template <typename Tkey> static unsigned priority(const Tkey&) {
+        return rand();
+    }
+};
+
+//The default: a splitmix64 generator with a separate state for each thread, seeded from random_device.
+struct RandomPriority {
+    static const bool canonical = false;
+
+    static uint64_t splitmix64(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    template <typename Tkey> static unsigned priority(const Tkey&) {
+        static thread_local uint64_t state = (uint64_t(random_device()()) << 32) ^ random_device()();
+        state += 0x9e3779b97f4a7c15ULL;
+        return unsigned(splitmix64(state) >> 32);
+    }
+};
+
+//The priority is a hash of the key.  Then the shape of a treap only depends on the set of keys in it, no
+//matter which operations built it, so two versions holding the same keys have the same shape.  It is also
+//deterministic from run to run.  std::hash is often the identity for integers, so its result is mixed
+//with the splitmix64 finalizer.  An adversary who knows the hash can pick keys that make a deep treap.
+struct HashPriority {
+    static const bool canonical = true;
+
+    template <typename Tkey> static unsigned priority(const Tkey& key) {
+        return unsigned(RandomPriority::splitmix64(hash<Tkey>()(key)) >> 32);
+    }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Key comparison
+//------------------------------------------------------------------------------------------------------------
+
+//The Compare parameter of PersistTreap orders the keys.  A policy provides compare(a, b), a three-way
+//comparison returning a negative number if a goes before b, zero if they are equivalent, and a positive
+//number otherwise.  A lookup compares once at each level and branches on the sign, instead of testing == and
+//then <.  Two keys are the same key when compare returns zero; == on Tkey is never used.
+
+template <typename T, typename = void>
+struct has_compare_member : false_type {};
+
+template <typename T>
+struct has_compare_member<T, decltype(void(int(declval<const T&>().compare(declval<const T&>()))))> : true_type {};
+
+//The default: the flags of a single compare for arithmetic keys, compare() for keys that have one (like
+//string, where it is one pass over the characters instead of two), and < both ways for anything else.
+struct DefaultCompare {
+    template <typename Tkey> static int compare(const Tkey& a, const Tkey& b) {
+        if constexpr (is_arithmetic<Tkey>::value) {
+            return int(b < a) - int(a < b);
+        } else if constexpr (has_compare_member<Tkey>::value) {
+            return a.compare(b);
+        } else {
+            return a < b ? -1 : (b < a ? 1 : 0);
+        }
+    }
+};
+
+//Orders the keys backwards, so iteration goes from the largest key to the smallest.
+template <typename Base = DefaultCompare>
+struct ReverseCompare {
+    template <typename Tkey> static int compare(const Tkey& a, const Tkey& b) {
+        return Base::compare(b, a);
+    }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Key search
+//------------------------------------------------------------------------------------------------------------
+
+//A hint to start loading the cache line at p, for the batched lookups.
+inline void prefetch(const void* p) {
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+}
+
+//BlockSearch<T>::count_less(keys, n, key) counts the keys in keys[0, n) smaller than key with vector
+//compares, lanes keys at a time.  On sorted keys that count is the lower bound, found without branches that
+//depend on the keys.  There are versions for 32- and 64-bit integers, float, and double with AVX2 (build
+//with -mavx2 or -march=native) and with NEON on AArch64.  The choice is made at compile time: for other key
+//types and targets vectorized is false, and then (or with a Compare other than DefaultCompare)
+//PersistBlockTreap uses std::lower_bound.  The float versions assume there are no NaN keys, which
+//lower_bound doesn't handle either.
+template <typename T, typename = void>
+struct BlockSearch {
+    static const bool vectorized = false;
+};
+
+template <typename T>
+using enable_if_int32 = typename enable_if<is_integral<T>::value && sizeof(T) == 4>::type;
+template <typename T>
+using enable_if_int64 = typename enable_if<is_integral<T>::value && sizeof(T) == 8>::type;
+
+#if defined(__AVX2__)
+
+//AVX2 only compares signed integers, so unsigned keys are compared with their top bit flipped.
+template <typename T>
+struct BlockSearch<T, enable_if_int32<T>> {
+    static const bool vectorized = true;
+    static const unsigned lanes = 8;
+
+    static unsigned count_less(const T* keys, unsigned n, const T& key) {
+        const uint32_t flip = is_signed<T>::value ? 0 : 0x80000000u;
+        const __m256i vflip = _mm256_set1_epi32(int32_t(flip));
+        const __m256i k = _mm256_set1_epi32(int32_t(uint32_t(key) ^ flip));
+        unsigned count = 0;
+        unsigned i = 0;
+        for (; i + lanes <= n; i += lanes) {
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), vflip);
+            count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, x))));
+        }
+        for (; i < n; i++) {
+            count += keys[i] < key;
+        }
+        return count;
+    }
+};
+
+template <typename T>
+struct BlockSearch<T, enable_if_int64<T>> {
+    static const bool vectorized = true;
+    static const unsigned lanes = 4;
+
+    static unsigned count_less(const T* keys, unsigned n, const T& key) {
+        const uint64_t flip = is_signed<T>::value ? 0 : 0x8000000000000000ULL;
+        const __m256i vflip = _mm256_set1_epi64x(int64_t(flip));
+        const __m256i k = _mm256_set1_epi64x(int64_t(uint64_t(key) ^ flip));
+        unsigned count = 0;
+        unsigned i = 0;
+        for (; i + lanes <= n; i += lanes) {
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), vflip);
+            count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, x))));
+        }
+        for (; i < n; i++) {
+            count += keys[i] < key;
+        }
+        return count;
+    }
+};
+
+template <>
+struct BlockSearch<float> {
+    static const bool vectorized = true;
+    static const unsigned lanes = 8;
+
+    static unsigned count_less(const float* keys, unsigned n, const float& key) {
+        const __m256 k = _mm256_set1_ps(key);
+        unsigned count = 0;
+        unsigned i = 0;
+        for (; i + lanes <= n; i += lanes) {
+            count += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(keys + i), k, _CMP_LT_OQ)));
+        }
+        for (; i < n; i++) {
+            count += keys[i] < key;
+        }
+        return count;
+    }
+};
+
+template <>
+struct BlockSearch<double> {
+    static const bool vectorized = true;
+    static const unsigned lanes = 4;
+
+    static unsigned count_less(const double* keys, unsigned n, const double& key) {
+        const __m256d k = _mm256_set1_pd(key);
+        unsigned count = 0;
+        unsigned i = 0;
+        for (; i + lanes <= n; i += lanes) {
+            count += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(keys + i), k, _CMP_LT_OQ)));
+        }
+        for (; i < n; i++) {
+            count += keys[i] < key;
+        }
+        return count;
+    }
+};
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+//A NEON compare sets a lane to all ones, so shifting each lane down to its low bit and adding the lanes
+//counts the matches.
+template <typename T>
+struct BlockSearch<T, enable_if_int32<T>> {
+    static const bool vectorized = true;
+    static const unsigned lanes = 4;
+
+    static uint32x4_t less(const T* keys, const T& key) {
+        if constexpr (is_signed<T>::value) {
+            return vcltq_s32(vld1q_s32((const int32_t*)keys), vdupq_n_s32(int32_t(key)));
+        } else {
+            return vcltq_u32(vld1q_u32((const uint32_t*)keys), vdupq_n_u32(uint32_t(key)));
+        }
+    }
+
+    static unsigned count_less(const T* keys, unsigned n, const T& key) {
+        unsigned count = 0;
+        unsigned i = 0;
+        for (; i + lanes <= n; i += lanes) {
+            count += vaddvq_u32(vshrq_n_u32(less(keys + i, key), 31));
+        }
+        for (; i < n; i++) {
+            count += keys[i] < key;
+        }
+        return count;
+    }
+};
+
+template <typename T>
+struct BlockSearch<T, enable_if_int64<T>> {
+    static const bool vectorized = true;
+    static const unsigned lanes = 2;
+
+    static uint64x2_t less(const T* keys, const T& key) {
+        if constexpr (is_signed<T>::value) {
+            return vcltq_s64(vld1q_s64((const int64_t*)keys), vdupq_n_s64(int64_t(key)));
+        } else {
+            return vcltq_u64(vld1q_u64((const uint64_t*)keys), vdupq_n_u64(uint64_t(key)));
+        }
+    }
+
+    static unsigned count_less(const T* keys, unsigned n, const T& key) {
+        unsigned count = 0;
+        unsigned i = 0;
+        for (; i + lanes <= n; i += lanes) {
+            count += unsigned(vaddvq_u64(vshrq_n_u64(less(keys + i, key), 63)));
+        }
+        for (; i < n; i++) {
+            count += keys[i] < key;
+        }
+        return count;
+    }
+};
+
+template <>
+struct BlockSearch<float> {
+    static const bool vectorized = true;
+    static const unsigned lanes = 4;
+
+    static unsigned count_less(const float* keys, unsigned n, const float& key) {
+        const float32x4_t k = vdupq_n_f32(key);
+        unsigned count = 0;
+        unsigned i = 0;
+        for (; i + lanes <= n; i += lanes) {
+            count += vaddvq_u32(vshrq_n_u32(vcltq_f32(vld1q_f32(keys + i), k), 31));
+        }
+        for (; i < n; i++) {
+            count += keys[i] < key;
+        }
+        return count;
+    }
+};
+
+template <>
+struct BlockSearch<double> {
+    static const bool vectorized = true;
+    static const unsigned lanes = 2;
+
+    static unsigned count_less(const double* keys, unsigned n, const double& key) {
+        const float64x2_t k = vdupq_n_f64(key);
+        unsigned count = 0;
+        unsigned i = 0;
+        for (; i + lanes <= n; i += lanes) {
+            count += unsigned(vaddvq_u64(vshrq_n_u64(vcltq_f64(vld1q_f64(keys + i), k), 63)));
+        }
+        for (; i < n; i++) {
+            count += keys[i] < key;
+        }
+        return count;
+    }
+};
+
+#endif
+
+//The Alloc parameter is any standard allocator; it is rebound to the node type.  PersistTreap only has
+//static helpers, so the allocator must be stateless (like std::allocator or PoolAllocator).
+//RefPolicy is SharedRef, IntrusiveRef<true>, or IntrusiveRef<false> (see above).
+//Augment is NoAugment, SizeAugment, Aggregate<Monoid>, MerkleHash, LazyUpdate<Tag>, or a combination of them
+//with Augments (see above).
+//Priority is RandomPriority, HashPriority, or RandPriority (see above).
+//Compare is DefaultCompare, ReverseCompare, or any other policy with a static three-way compare (see above).
+
+//the benchmarks at the end of the file time the private engines directly
+struct TreapBench;
+
+template <typename Tkey, typename Tval, typename Alloc = allocator<char>, typename RefPolicy = SharedRef,
+          typename Augment = NoAugment, typename Priority = RandomPriority, typename Compare = DefaultCompare>
 struct PersistTreap {
+    friend struct TreapBench;
+
+    public:
+
+        //The key and value stored in a node.  Lookups return a pointer to the Entry inside the node instead of
+        //copying it out.  The pointer stays valid as long as some treap holding that node exists.
+        struct Entry {
+            Tkey key;
+            Tval val;
+        };
+
+    private:
+
+        struct Node;
+        typedef typename allocator_traits<Alloc>::template rebind_alloc<Node> NodeAlloc;
+        typedef typename RefPolicy::template ptr<Node, NodeAlloc> NodePtr;
+
+        struct Node : RefPolicy::Hook, Entry, Augment::Data {
+            unsigned p;
+            NodePtr left;
+            NodePtr right;
+       
+            //frees the children without recursing (see Reclaimer)
+            ~Node() {
+                NodeReclaimer<NodePtr, RefPolicy>::release(left, right);
+            }
+        };
+
+        static_assert(is_empty<Alloc>::value, "PersistTreap needs a stateless allocator");
+        static_assert(!Augment::has_lazy || !(Augment::has_aggregate || Augment::has_hash),
+                      "LazyUpdate can't be combined with Aggregate or MerkleHash");
+
+        typedef typename Augment::tag Tag;
+        typedef typename Tag::type TagType;
+
+        NodePtr root;
+
+        //------------------------------------------------------------------------------------------------------------
+        // Node creation
+        //------------------------------------------------------------------------------------------------------------
+
+        //All nodes are created here.  With SharedRef, allocate_shared puts the node and the shared_ptr
+        //control block into a single allocation from Alloc.
+        static NodePtr new_node() {
+            TreapStats::allocated(node_bytes);
+            return RefPolicy::template make<Node>(NodeAlloc());
+        }
+
+        //Create a new node with the same key, value, and priority as v but no children.
+        static NodePtr clone(const NodePtr& v) {
+            TreapStats::clone();
+            NodePtr w = new_node();
+            //one assignment of the whole entry, which is a single block copy when it is trivially copyable
+            static_cast<Entry&>(*w) = static_cast<const Entry&>(*v);
+            w->p = v->p;
+            return w;
+        }
+
+        //Transient updates: every operation that changes nodes takes the NodePtrs it changes by value.  When
+        //the owner of a version moves it into an operation and no other version shares a node, the parameter
+        //holds the only reference to it.  Nobody else can see such a node, so it is changed in place instead
+        //of cloned, and its children are moved out so they are only referenced by the operation too (unless
+        //some other version shares them).  So a chain of updates on a treap with a single owner, like
+        //t = move(t).insert(k, v), reuses its whole path.  An operation on a treap that is still held
+        //elsewhere always sees a count of at least two and clones as before.  Moving a treap into an
+        //operation invalidates iterators and lookup pointers into it.
+        //
+        //The engines below build a changed node with unpack and reuse.  unpack copies v's children into left
+        //and right, or moves them out if v holds the only reference to its node, and returns which it did.
+        //With LazyUpdate this is also where a pending update moves down to the children (see tagged).
+        static bool unpack(NodePtr& v, NodePtr& left, NodePtr& right) {
+            bool own = RefPolicy::unique(v);
+            if (own) {
+                left = move(v->left);
+                right = move(v->right);
+            } else {
+                left = v->left;
+                right = v->right;
+            }
+            if constexpr (Augment::has_lazy) {
+                if (!Tag::is_identity(v->lazy)) {
+                    left = tagged(move(left), v->lazy);
+                    right = tagged(move(right), v->lazy);
+                    //a clone starts with nothing pending, but v itself is reused as it is
+                    if (own) {
+                        v->lazy = Tag::identity();
+                    }
+                }
+            }
+            return own;
+        }
+
+        //Returns v with the update t applied to its value and composed into its lazy field: v's own node if
+        //this is the only reference to it, otherwise a copy with the same children and augmented data.
+        static NodePtr tagged(NodePtr v, const TagType& t) {
+            if (!v) {
+                return v;
+            }
+            if (RefPolicy::unique(v)) {
+                TreapStats::reused();
+            } else {
+                TreapStats::clone();
+                NodePtr w = new_node();
+                static_cast<Entry&>(*w) = static_cast<const Entry&>(*v);
+                static_cast<typename Augment::Data&>(*w) = static_cast<const typename Augment::Data&>(*v);
+                w->p = v->p;
+                w->left = v->left;
+                w->right = v->right;
+                v = move(w);
+            }
+            Tag::apply(t, v->val);
+            v->lazy = Tag::compose(t, v->lazy);
+            return v;
+        }
+
+        //The updates pending above the children of v, given the ones pending above v
+        static TagType tag_below(const TagType& above_v, const Node* v) {
+            if constexpr (Augment::has_lazy) {
+                return Tag::compose(above_v, v->lazy);
+            } else {
+                (void)v;
+                return above_v;
+            }
+        }
+
+        //Returns a node with v's key, value, and priority to set new children on: v's own node if unpack said
+        //it was the only reference, otherwise a clone.
+        static NodePtr reuse(NodePtr& v, bool own) {
+            if (own) {
+                TreapStats::reused();
+                return move(v);
+            }
+            return clone(v);
+        }
+
+        static int key_compare(const Tkey& a, const Tkey& b) {
+            return Compare::compare(a, b);
+        }
+
+        static bool key_less(const Tkey& a, const Tkey& b) {
+            return Compare::compare(a, b) < 0;
+        }
+
+        //True if a belongs above b: a has a smaller priority, or the same priority and a smaller key.
+        static bool above(const Node* a, const Node* b) {
+            return a->p < b->p || (a->p == b->p && key_less(a->key, b->key));
+        }
+
+        static bool above(unsigned p1, const Tkey& key1, const Node* b) {
+            return p1 < b->p || (p1 == b->p && key_less(key1, b->key));
+        }
+
+        //Recompute the augmented data of a new node once its children are set.
+        static void pull(Node* w) {
+            Augment::pull(*w);
+        }
+
+        //split_loop, join_loop, and the point operations create clones on the way down and only fill in their
+        //children later, so they can't pull a clone right after making it.  Instead they push each clone on
+        //a PullStack and pull them all at the end in reverse order, so children are pulled before parents.
+        //With NoAugment push does nothing and the whole thing compiles away.
+        struct PullStack {
+            static const size_t inline_size = 64;
+            Node* small[inline_size];
+            vector<Node*> big;
+            size_t n = 0;
+
+            void push(Node* v) {
+                if (!Augment::enabled) {
+                    return;
+                }
+                if (n < inline_size) {
+                    small[n] = v;
+                } else {
+                    big.push_back(v);
+                }
+                n++;
+            }
+
+            void pull_all() {
+                while (n > 0) {
+                    n--;
+                    pull(n < inline_size ? small[n] : big[n - inline_size]);
+                }
+            }
+        };
+
+        //The turns modify_node takes on its way down to a key, one bit per node with 1 for right, so it can
+        //find the key before it clones anything and then clone the path without comparing keys again
+        struct Turns {
+            static const size_t inline_words = 2;
+            uint64_t small[inline_words] = {};
+            vector<uint64_t> big;
+            size_t n = 0;
+
+            void push(bool right) {
+                size_t word = n / 64;
+                if (word >= inline_words && word - inline_words == big.size()) {
+                    big.push_back(0);
+                }
+                if (right) {
+                    (word < inline_words ? small[word] : big[word - inline_words]) |= uint64_t(1) << (n % 64);
+                }
+                n++;
+            }
+
+            bool right(size_t i) const {
+                size_t word = i / 64;
+                return ((word < inline_words ? small[word] : big[word - inline_words]) >> (i % 64)) & 1;
+            }
+        };
+
+        static size_t subtree_size(const Node* v) {
+            static_assert(Augment::has_size, "size, rank, select, and count_range need the SizeAugment policy");
+            return v ? v->size : 0;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Split
+        //------------------------------------------------------------------------------------------------------------
+
+        //A recursive implementation of split that is almost a direct translation of the pseudocode.
+        //It uses a tuple (http://www.cplusplus.com/reference/tuple/tuple/) to return multiple values.
+        //It also uses tie (http://www.cplusplus.com/reference/tuple/tie/) to destruct the return tuple.
+
+        static tuple<NodePtr, NodePtr, NodePtr> split_rec(NodePtr v, const Tkey& key) {
+            //returns a tuple (t1, t2, a) where t1 is a root of a treap of all elements smaller than key,
+            //t2 is the root of a treap of all elements larger than key, and a is a node equal to key.
+
+            if (!v) {
+                return make_tuple(v, v, v);
+            }
+            TreapStats::step();
+
+            //the children of v, moved out of it if v can be changed in place (see unpack)
+            NodePtr left, right;
+            bool own = unpack(v, left, right);
+
+            int c = key_compare(key, v->key);
+            if (c == 0) {
+                //We have found the node to split around: set the output parameters instead of returning them.
+                return make_tuple(move(left), move(right), move(v));
+
+            } else if (c < 0) {
+                //key is somewhere to the left of v
+
+                NodePtr r1, r2, a;
+                tie(r1, r2, a) = split_rec(move(left), key);
+
+                //create a clone of v
+                NodePtr vclone = reuse(v, own);
+                vclone->left = move(r2);
+                vclone->right = move(right);
+                pull(vclone.get());
+
+                return make_tuple(move(r1), move(vclone), move(a));
+                
+            } else {
+                //key is somewhere to the right of v
+                NodePtr r1, r2, a;
+                tie(r1, r2, a) = split_rec(move(right), key);
+
+                //create a clone of v
+                NodePtr vclone = reuse(v, own);
+                vclone->left = move(left);
+                vclone->right = move(r1);
+                pull(vclone.get());
+
+                return make_tuple(move(vclone), move(r2), move(a));
+            }
+        }
+
+        //I spent some time trying to make the above recursive split tail-recursive in a way that g++ could optimize.
+        //I eventually succeeded, but the main difficulty is the use of shared_ptrs.  Each shared_ptr has a destructor and the C++
+        //standard says that destructors are run at the end of the block.  The execution of this destructor therefore happens after
+        //the recursive call, making the recursive call NOT a tail-call since there is work after the recursion returns.  I worked
+        //around this with a combination of raw pointers and switching between shared and raw pointers, but it got really messy.
+        //
+        //So instead, I decided it would be much cleaner to manually convert split into a loop.  Essentially manually performing
+        //the tail-call optimization.  Here is the result.
+        
+        static tuple<NodePtr, NodePtr, NodePtr> split_loop(NodePtr v, const Tkey& key) {
+            //result1, result2, and a hold the final result we will return, where result1 is the treap of stuff smaller than key,
+            //result2 is the treap of stuff larger than key, and a is a node potentially equal to key.
+            NodePtr result1, result2, a;
+
+            //t1 and t2 are pointers to shared_ptrs.  When the recursive version above would return t1 and t2,
+            //instead the loop below will set the shared_ptr into the memory pointed to by t1 or t2.
+            NodePtr *t1, *t2;
+           
+            //Initially, t1 should point at result1 and t2 should point at result2
+            t1 = &result1;
+            t2 = &result2;
+
+            //the clones, to pull once their children are known
+            PullStack clones;
+
+            //Loop until v is nil
+            while (v) {
+                TreapStats::step();
+
+                //the children of v, moved out of it if v can be changed in place (see unpack)
+                NodePtr left, right;
+                bool own = unpack(v, left, right);
+
+                int c = key_compare(key, v->key);
+                if (c == 0) {
+                    //If v equals key, set the shared_ptr pointed to by t1 to v->left and
+                    //set the shared_ptr pointed to by t2 to v->right.
+                    *t1 = move(left);
+                    *t2 = move(right);
+                    a = move(v);
+                    break;
+
+                } else if (c < 0) {
+
+                    //First, create a clone of v
+                    NodePtr vclone = reuse(v, own);
+                    vclone->right = move(right);
+                    Node* w = vclone.get();
+                    clones.push(w);
+
+                    //vclone is the root of a treap of elements below v with values
+                    //larger than x, so the vclone shared_ptr should be set in the memory pointed
+                    //to by t2
+                    *t2 = move(vclone);
+
+                    //Now set the t2 pointer to point to the memory inside vclone holding the left shared_ptr.
+                    //What will then happen is that the next time *t2 is set to something, that shared_ptr
+                    //will be set into the memory inside the Node struct holding left.
+                    t2 = &w->left;
+
+                    //descend to the left
+                    v = move(left);
+
+                } else {
+                    //make a clone of v
+                    NodePtr vclone = reuse(v, own);
+                    vclone->left = move(left);
+                    Node* w = vclone.get();
+                    clones.push(w);
+
+                    //vclone is the root of a treap of stuff below v which is smaller than key, so is set
+                    //into the memory pointed to by t1.
+                    *t1 = move(vclone);
+
+                    //Set t1 so the next time *t1 is set it becomes the right child of vclone
+                    t1 = &w->right;
+
+                    //descend to the right
+                    v = move(right);
+                }
+            }
+
+            clones.pull_all();
+            return make_tuple(move(result1), move(result2), move(a));
+        }
+
+        //A helper function allowing you to switch between the recursive or the loop version.
+        static tuple<NodePtr, NodePtr, NodePtr> split(NodePtr v, const Tkey& key) {
+            TreapStats::Scope scope(TreapStats::SPLIT);
+            //return split_rec(move(v), key);
+            return split_loop(move(v), key);
+        }
+
+        //Like split, but the node equal to key goes into t2 instead of being returned on its own.
+        static pair<NodePtr, NodePtr> split_keep(NodePtr v, const Tkey& key) {
+            NodePtr t1, t2, a;
+            tie(t1, t2, a) = split(move(v), key);
+            if (a) {
+                //a may still point at its old children, so it goes back in as a childless copy (or itself, if
+                //this is the only reference).  It is the smallest element of t2, so joining puts it in place.
+                NodePtr left, right;
+                bool own = unpack(a, left, right);
+                NodePtr w = reuse(a, own);
+                pull(w.get());
+                t2 = join(move(w), move(t2));
+            }
+            return make_pair(move(t1), move(t2));
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Join
+        //------------------------------------------------------------------------------------------------------------
+
+        static NodePtr join_rec(NodePtr v1, NodePtr v2) {
+            //join takes as input two nodes v1 and v2, where the elements in v1 have smaller keys than elements
+            //in v2.  There is return value is the new root of a treap consisting of the union of the elements
+            //from v1 and v2.
+            TreapStats::step();
+
+            //If either v1 or v2 is nil, set the return value to be the other
+            if (!v1) {
+                return v2;
+
+            } else if (!v2) {
+                return v1;
+
+            } else if (above(v1.get(), v2.get())) {
+                //make a clone of v1 since v1 will become the new root
+                NodePtr left, right;
+                bool own = unpack(v1, left, right);
+                NodePtr w = reuse(v1, own);
+
+                //the left child is unchanged
+                w->left = move(left);
+
+                //the right child is joined to v2
+                w->right = join_rec(move(right), move(v2));
+                pull(w.get());
+
+                return w;
+
+            } else {
+                //make a clone of v2 since v2 will become the new root
+                NodePtr left, right;
+                bool own = unpack(v2, left, right);
+                NodePtr w = reuse(v2, own);
+
+                //the right child is unchanged
+                w->right = move(right);
+
+                //the left child is joined to v1
+                w->left = join_rec(move(v1), move(left));
+                pull(w.get());
+
+                return w;
+            }
+        }
+
+        //The above join is not tail-recursive.  Just like split, it can be made tail-recursive but the
+        //shared_ptr destructors make it complicated.  Instead, in my opinion the best way of optimizing join
+        //is to explicitly convert it to a loop, like I did in split_loop.
+        //
+        //Here is that loop.  join only ever recurses into one child, and the result of the recursion is
+        //just stored as a child of the clone, so the same trick as split_loop works: t points at the
+        //NodePtr where the result of the "recursive call" should be stored.
+
+        static NodePtr join_loop(NodePtr v1, NodePtr v2) {
+            NodePtr result;
+            NodePtr* t = &result;
+            PullStack clones;
+
+            while (true) {
+                TreapStats::step();
+                if (!v1) {
+                    *t = move(v2);
+                    break;
+
+                } else if (!v2) {
+                    *t = move(v1);
+                    break;
+
+                } else if (above(v1.get(), v2.get())) {
+                    //v1 becomes the root with its left child unchanged, and its right child will be set
+                    //by a later iteration to the join of v1->right and v2
+                    NodePtr left, right;
+                    bool own = unpack(v1, left, right);
+                    NodePtr w = reuse(v1, own);
+                    w->left = move(left);
+                    Node* raw = w.get();
+                    clones.push(raw);
+                    *t = move(w);
+                    t = &raw->right;
+                    v1 = move(right);
+
+                } else {
+                    //v2 becomes the root with its right child unchanged
+                    NodePtr left, right;
+                    bool own = unpack(v2, left, right);
+                    NodePtr w = reuse(v2, own);
+                    w->right = move(right);
+                    Node* raw = w.get();
+                    clones.push(raw);
+                    *t = move(w);
+                    t = &raw->left;
+                    v2 = move(left);
+                }
+            }
+
+            clones.pull_all();
+            return result;
+        }
+
+        //A helper function allowing you to switch between the recursive or the loop version.
+        static NodePtr join(NodePtr v1, NodePtr v2) {
+            TreapStats::Scope scope(TreapStats::JOIN);
+            //return join_rec(move(v1), move(v2));
+            return join_loop(move(v1), move(v2));
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Union
+        //------------------------------------------------------------------------------------------------------------
+
+        //The recursive set operations count how deep they are, and a call deeper than max_recursion hands its
+        //subtrees to set_op_loop, which keeps its stack on the heap.  With random priorities a treap is
+        //about 2-3 log2(n) deep, so only a treap whose priorities aren't random, like a HashPriority treap
+        //fed keys chosen to collide, gets that far.
+        static const int max_recursion = 128;
+
+        static NodePtr union_helper(NodePtr v1, NodePtr v2, int depth = 0) {
+            //union takes as input two nodes v1 and v2 and returns a node for the left-biased union
+            if (depth > max_recursion) {
+                return set_op_loop<UNION>(move(v1), move(v2));
+            }
+            TreapStats::step();
+
+            //If either v1 or v2 is nil, 
+            if (!v1) {
+                return v2;
+
+            } else if (!v2) {
+                return v1;
+
+            } else if (v1 == v2) {
+                //Both sides are the same subtree, which happens all the time between a version and a version
+                //derived from it (and, after HashCons::intern, between any identical subtrees).
+                return v1;
+
+            } else if (above(v1.get(), v2.get())) {
+                //v1 will become the new root of the union, so split v2 around
+                //v1->key, getting t1, t2, and a as output
+                NodePtr t1, t2, a;
+                tie(t1, t2, a) = split(move(v2), v1->key);
+
+                //create a clone of v1
+                NodePtr left, right;
+                bool own = unpack(v1, left, right);
+                NodePtr w = reuse(v1, own);
+                w->left = union_helper(move(left), move(t1), depth + 1);
+                w->right = union_helper(move(right), move(t2), depth + 1);
+                pull(w.get());
+                return w;
+
+            } else {
+                //v2 will become the new root of the union, so split v1
+                //around v2->key, getting t1, t2, and a as output
+                NodePtr t1, t2, a;
+                tie(t1, t2, a) = split(move(v1), v2->key);
+
+                //clone of v2
+                NodePtr left, right;
+                bool own = unpack(v2, left, right);
+                NodePtr w = reuse(v2, own);
+                if (a) {
+                    //to be left-biased, use the value from v1
+                    w->val = a->val;
+                }
+                //otherwise v2->key does not exist in v1, so keep v2->val
+                w->left = union_helper(move(t1), move(left), depth + 1);
+                w->right = union_helper(move(t2), move(right), depth + 1);
+                pull(w.get());
+                return w;
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Intersection
+        //------------------------------------------------------------------------------------------------------------
+
+        static NodePtr intersect_helper(NodePtr v1, NodePtr v2, int depth = 0) {
+            //intersect_helper takes as input two nodes v1 and v2 and returns a new node for the intersection
+            //of v1 and v2.  The values from v1 are used.
+            if (depth > max_recursion) {
+                return set_op_loop<INTERSECT>(move(v1), move(v2));
+            }
+            TreapStats::step();
+            
+            if (!v1 || !v2) {
+                return NULL;
+            
+            } else if (v1 == v2) {
+                //the same subtree on both sides, see union_helper
+                return v1;
+
+            } else if (above(v1.get(), v2.get())) {
+                //v1 is potentially the new root, so split v2 around v1->key
+                NodePtr r1, r2, a;
+                tie(r1, r2, a) = split(move(v2), v1->key);
+
+                NodePtr left1, right1;
+                bool own = unpack(v1, left1, right1);
+                //intersect the stuff smaller than v1->key
+                NodePtr left = intersect_helper(move(left1), move(r1), depth + 1);
+                //intersect the stuff larger than v1->key
+                NodePtr right = intersect_helper(move(right1), move(r2), depth + 1);
+
+                if (!a) {
+                    //v1->key does not exist in v2, so v1 should not appear in the output.
+                    //Instead, join left and right
+                    return join(move(left), move(right));
+                } else {
+                    //make a clone of v1
+                    NodePtr w = reuse(v1, own);
+                    w->left = move(left);
+                    w->right = move(right);
+                    pull(w.get());
+                    return w;
+                }
+
+            } else {
+                //v2 is potentially the new root, so split v1 around v2->key
+                NodePtr r1, r2, a;
+                tie(r1, r2, a) = split(move(v1), v2->key);
+
+                NodePtr left2, right2;
+                bool own = unpack(v2, left2, right2);
+                //intersect the stuff smaller and larger than v2->key
+                NodePtr left = intersect_helper(move(r1), move(left2), depth + 1);
+                NodePtr right = intersect_helper(move(r2), move(right2), depth + 1);
+
+                if (!a) {
+                    //v2->key is not in v1, so join left and right ignoring v2 itself
+                    return join(move(left), move(right));
+                } else {
+                    //make a clone of v2
+                    NodePtr w = reuse(v2, own);
+                    w->val = a->val; //use the value from v1 so the intersect is left-biased
+                    w->left = move(left);
+                    w->right = move(right);
+                    pull(w.get());
+                    return w;
+                }
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Difference
+        //------------------------------------------------------------------------------------------------------------
+
+        static NodePtr difference_helper(NodePtr v1, NodePtr v2, int depth = 0) {
+            //TODO: you write this
+            if (depth > max_recursion) {
+                return set_op_loop<DIFFERENCE>(move(v1), move(v2));
+            }
+            TreapStats::step();
+	    if (!v1) {
+                return NULL;
+            } else if (!v2) {
+                return v1;	
+            } else if (v1 == v2) {
+                //the same subtree on both sides, see union_helper
+                return NULL;
+            } else {//used to be (v1->p < v2->p)
+                //v1 is potentially the new root, so split v2 around v1->key
+                NodePtr r1, r2, a;
+                tie(r1, r2, a) = split(move(v2), v1->key);
+
+                NodePtr left1, right1;
+                bool own = unpack(v1, left1, right1);
+                //intersect the stuff smaller than v1->key
+                NodePtr left = difference_helper(move(left1), move(r1), depth + 1);
+                //intersect the stuff larger than v1->key
+                NodePtr right = difference_helper(move(right1), move(r2), depth + 1);
+
+                if (!a) {
+                    //v1->key does not exist in v2, so v1 should appear in the output.
+		    //make a clone of v1
+                    NodePtr w = reuse(v1, own);
+                    w->left = move(left);
+                    w->right = move(right);
+                    pull(w.get());
+                    return w;
+                } else {
+		    //v1 exists in v2
+                    //join left and right
+                     return join(move(left), move(right));
+                }
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Loop version of the set operations
+        //------------------------------------------------------------------------------------------------------------
+
+        //union_helper, intersect_helper, and difference_helper recurse twice, so unlike split and join they
+        //can't be turned into a simple loop.  Instead, set_op_loop runs all three with an explicit stack
+        //so that the depth of the treap doesn't turn into depth of the C++ stack.
+        //
+        //The work stack holds two kinds of frames.  A call frame is a pair (v1, v2) that the recursive
+        //version would call itself on.  A combine frame is the work the recursive version does after both
+        //recursive calls return: it pops the left and right results off the results stack and either sets
+        //them as the children of the clone w or, when the root key was dropped, joins them.  The call frames
+        //for the left and right halves are pushed after the combine frame so they run (and push their
+        //results) before it.
+
+        enum SetOp { UNION, INTERSECT, DIFFERENCE };
+
+        struct SetOpFrame {
+            NodePtr v1, v2;
+            bool combine;
+            //for a combine frame, w is the clone to hang the results on (or nil to join the results)
+            NodePtr w;
+        };
+
+        template <SetOp op>
+        static NodePtr set_op_loop(NodePtr v1, NodePtr v2) {
+            vector<SetOpFrame> work;
+            vector<NodePtr> results;
+            work.push_back(SetOpFrame{move(v1), move(v2), false, NodePtr()});
+
+            while (!work.empty()) {
+                SetOpFrame f = move(work.back());
+                work.pop_back();
+                TreapStats::step();
+
+                if (f.combine) {
+                    NodePtr right = move(results.back());
+                    results.pop_back();
+                    NodePtr left = move(results.back());
+                    results.pop_back();
+
+                    if (f.w) {
+                        f.w->left = move(left);
+                        f.w->right = move(right);
+                        pull(f.w.get());
+                        results.push_back(move(f.w));
+                    } else {
+                        results.push_back(join(move(left), move(right)));
+                    }
+                    continue;
+                }
+
+                //the base cases are the same as in the recursive helpers
+                if (!f.v1) {
+                    results.push_back(op == UNION ? move(f.v2) : NodePtr());
+                    continue;
+                } else if (!f.v2) {
+                    results.push_back(op == INTERSECT ? NodePtr() : move(f.v1));
+                    continue;
+                } else if (f.v1 == f.v2) {
+                    results.push_back(op == DIFFERENCE ? NodePtr() : move(f.v1));
+                    continue;
+                }
+
+                //pick the root the same way as the recursive helpers: the node with the smaller priority,
+                //except for difference which always keeps the structure of v1
+                bool v1_root = op == DIFFERENCE || above(f.v1.get(), f.v2.get());
+
+                NodePtr r1, r2, a, w, c1, c2;
+                SetOpFrame left, right;
+                if (v1_root) {
+                    tie(r1, r2, a) = split(move(f.v2), f.v1->key);
+                    bool own = unpack(f.v1, c1, c2);
+                    //v1 is kept by union always, by intersection if it is also in v2, and by difference if not
+                    if (op == UNION || (op == INTERSECT) == bool(a)) {
+                        w = reuse(f.v1, own);
+                    }
+                    left = SetOpFrame{move(c1), move(r1), false, NodePtr()};
+                    right = SetOpFrame{move(c2), move(r2), false, NodePtr()};
+                } else {
+                    tie(r1, r2, a) = split(move(f.v1), f.v2->key);
+                    bool own = unpack(f.v2, c1, c2);
+                    if (op == UNION || a) {
+                        //use the value from v1 if it exists so the result is left-biased
+                        w = reuse(f.v2, own);
+                        if (a) {
+                            w->val = a->val;
+                        }
+                    }
+                    left = SetOpFrame{move(r1), move(c1), false, NodePtr()};
+                    right = SetOpFrame{move(r2), move(c2), false, NodePtr()};
+                }
+
+                work.push_back(SetOpFrame{NodePtr(), NodePtr(), true, move(w)});
+                work.push_back(move(right));
+                work.push_back(move(left));
+            }
+
+            return move(results.back());
+        }
+
+        //Entry points for the set operations.  On treaps with reasonable priorities the recursion depth is
+        //O(log n) and the recursive version was around 20% faster when I timed it (the work and results
+        //vectors cost something), so they start with it; the helpers switch to set_op_loop for whatever is
+        //left below max_recursion, so a deep treap doesn't overflow the C++ stack.
+        static NodePtr union_nodes(NodePtr v1, NodePtr v2) {
+            TreapStats::Scope scope(TreapStats::UNION);
+            return union_helper(move(v1), move(v2));
+        }
+
+        static NodePtr intersect_nodes(NodePtr v1, NodePtr v2) {
+            TreapStats::Scope scope(TreapStats::INTERSECT);
+            return intersect_helper(move(v1), move(v2));
+        }
+
+        static NodePtr difference_nodes(NodePtr v1, NodePtr v2) {
+            TreapStats::Scope scope(TreapStats::DIFFERENCE);
+            return difference_helper(move(v1), move(v2));
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Parallel version of the set operations
+        //------------------------------------------------------------------------------------------------------------
+
+        //set_op_par is the recursive helper for all three operations with the left recursive call forked onto
+        //the ForkJoinPool while this thread does the right one.  Once depth reaches zero it switches back to
+        //the sequential helpers, so small pieces of work don't pay for tasks.
+
+        template <SetOp op>
+        static NodePtr set_op_par(NodePtr v1, NodePtr v2, int depth, size_t grain) {
+            bool small = false;
+            if constexpr (Augment::has_size) {
+                small = subtree_size(v1.get()) + subtree_size(v2.get()) < grain;
+            }
+            if (depth <= 0 || small || !v1 || !v2 || v1 == v2) {
+                //the sequential helpers (which also handle the base cases)
+                if (op == UNION) {
+                    return union_nodes(move(v1), move(v2));
+                } else if (op == INTERSECT) {
+                    return intersect_nodes(move(v1), move(v2));
+                } else {
+                    return difference_nodes(move(v1), move(v2));
+                }
+            }
+
+            //pick the root and split the same way as set_op_loop
+            bool v1_root = op == DIFFERENCE || above(v1.get(), v2.get());
+
+            NodePtr a, w;
+            NodePtr left1, left2, right1, right2;
+            if (v1_root) {
+                tie(left2, right2, a) = split(move(v2), v1->key);
+                bool own = unpack(v1, left1, right1);
+                if (op == UNION || (op == INTERSECT) == bool(a)) {
+                    w = reuse(v1, own);
+                }
+            } else {
+                tie(left1, right1, a) = split(move(v1), v2->key);
+                bool own = unpack(v2, left2, right2);
+                if (op == UNION || a) {
+                    w = reuse(v2, own);
+                    if (a) {
+                        w->val = a->val;
+                    }
+                }
+            }
+
+            NodePtr left;
+            ForkJoinPool::Task task([&] { left = set_op_par<op>(move(left1), move(left2), depth - 1, grain); });
+            ForkJoinPool& pool = ForkJoinPool::instance();
+            pool.fork(task);
+            NodePtr right;
+            try {
+                right = set_op_par<op>(move(right1), move(right2), depth - 1, grain);
+            } catch (...) {
+                //the task refers to this frame, so it must finish before the exception leaves
+                try {
+                    pool.join(task);
+                } catch (...) {
+                }
+                throw;
+            }
+            pool.join(task);
+
+            if (w) {
+                w->left = move(left);
+                w->right = move(right);
+                pull(w.get());
+                return w;
+            } else {
+                return join(move(left), move(right));
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Many-way set operations
+        //------------------------------------------------------------------------------------------------------------
+
+        //Combines the n roots at first with op as a balanced tree: each half is reduced on its own and the two
+        //results are combined.  Folding k treaps one at a time runs k - 1 operations with one ever growing
+        //side; the balanced tree only takes log k rounds, and each round combines treaps of similar size,
+        //which is where the set operations do best.  For the first depth levels the left half is forked onto
+        //the ForkJoinPool, and the combining step is a set_op_par with the rest of the depth.  With depth 0
+        //everything runs sequentially on this thread.
+        template <SetOp op>
+        static NodePtr reduce_all(NodePtr* first, size_t n, int depth, size_t grain) {
+            if (n == 1) {
+                return move(first[0]);
+            }
+            size_t half = n / 2;
+            NodePtr left, right;
+            if (depth <= 0) {
+                left = reduce_all<op>(first, half, 0, grain);
+                right = reduce_all<op>(first + half, n - half, 0, grain);
+                if (op == UNION) {
+                    return union_nodes(move(left), move(right));
+                } else {
+                    return intersect_nodes(move(left), move(right));
+                }
+            }
+
+            ForkJoinPool::Task task([&] { left = reduce_all<op>(first, half, depth - 1, grain); });
+            ForkJoinPool& pool = ForkJoinPool::instance();
+            pool.fork(task);
+            try {
+                right = reduce_all<op>(first + half, n - half, depth - 1, grain);
+            } catch (...) {
+                //the task refers to this frame, so it must finish before the exception leaves
+                try {
+                    pool.join(task);
+                } catch (...) {
+                }
+                throw;
+            }
+            pool.join(task);
+            return set_op_par<op>(move(left), move(right), depth, grain);
+        }
+
+        //The roots of the treaps in [begin, end).  A treap is copied out of *it, so move iterators hand over
+        //the references and let the operations change unshared nodes in place.
+        template <typename It>
+        static vector<NodePtr> take_roots(It begin, It end) {
+            vector<NodePtr> roots;
+            for (It it = begin; it != end; ++it) {
+                PersistTreap t = *it;
+                roots.push_back(move(t.root));
+            }
+            return roots;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Point operations
+        //------------------------------------------------------------------------------------------------------------
+
+        //insert used to be a union with a singleton treap, and remove a difference with one.  That allocates the
+        //singleton and runs the whole set operation machinery just to change one key.  The functions below
+        //instead descend once from the root, cloning the nodes along the path using the same output-slot
+        //trick as split_loop.
+
+        static unsigned new_priority(const Tkey& key) {
+            return Priority::priority(key);
+        }
+
+        //Inserts key with priority p.  Going down the path to key, the new node belongs at the first node
+        //that doesn't belong above it (see above()): the new node replaces it, and the subtree there is split around key
+        //to give the new node's children.  If key is found on the way down, only its value is replaced.
+        //Sets inserted to false if the key was already in the treap.
+        static NodePtr insert_node(NodePtr v, Tkey key, Tval val, unsigned p, bool& inserted) {
+            NodePtr result;
+            NodePtr* t = &result;
+            PullStack clones;
+
+            while (v && !above(p, key, v.get())) {
+                TreapStats::step();
+                NodePtr left, right;
+                bool own = unpack(v, left, right);
+                NodePtr vclone = reuse(v, own);
+                Node* w = vclone.get();
+                *t = move(vclone);
+                clones.push(w);
+
+                int c = key_compare(key, w->key);
+                if (c == 0) {
+                    //the key already exists and is above where the new node would go, so just replace the value
+                    w->val = move(val);
+                    w->left = move(left);
+                    w->right = move(right);
+                    inserted = false;
+                    clones.pull_all();
+                    return result;
+
+                } else if (c < 0) {
+                    w->right = move(right);
+                    t = &w->left;
+                    v = move(left);
+
+                } else {
+                    w->left = move(left);
+                    t = &w->right;
+                    v = move(right);
+                }
+            }
+
+            NodePtr n = new_node();
+            n->key = move(key);
+            n->val = move(val);
+            n->p = p;
+            NodePtr a;
+            tie(n->left, n->right, a) = split(move(v), n->key);
+            pull(n.get());
+            //if the key was further down, split removed it
+            inserted = !a;
+            *t = move(n);
+            clones.pull_all();
+            return result;
+        }
+
+        //Clones the path down to the node with key and stores replace(node) where the node was.  replace gets
+        //the NodePtr to the node and can unpack and reuse it.  The node returned by replace must already be
+        //pulled.
+        //The key is looked for first, without touching the treap, and the turns taken on the way are kept in
+        //Turns.  If key isn't in the treap this sets found to false and returns v as it is, so a miss costs
+        //no allocations; otherwise the path is cloned by following the turns, without comparing keys again.
+        template <typename Fn>
+        static NodePtr modify_node(NodePtr v, const Tkey& key, Fn replace, bool& found) {
+            Turns turns;
+            const Node* u = v.get();
+            while (u) {
+                TreapStats::step();
+                int c = key_compare(key, u->key);
+                if (c == 0) {
+                    break;
+                }
+                turns.push(c > 0);
+                u = c < 0 ? u->left.get() : u->right.get();
+            }
+            found = u != nullptr;
+            if (!found) {
+                return v;
+            }
+
+            NodePtr result;
+            NodePtr* t = &result;
+            PullStack clones;
+
+            for (size_t i = 0; i < turns.n; i++) {
+                NodePtr left, right;
+                bool own = unpack(v, left, right);
+                NodePtr vclone = reuse(v, own);
+                Node* w = vclone.get();
+                *t = move(vclone);
+                clones.push(w);
+
+                if (!turns.right(i)) {
+                    w->right = move(right);
+                    t = &w->left;
+                    v = move(left);
+
+                } else {
+                    w->left = move(left);
+                    t = &w->right;
+                    v = move(right);
+                }
+            }
+
+            *t = replace(v);
+            clones.pull_all();
+            return result;
+        }
+
+        static pair<PersistTreap, bool> insert_root(NodePtr v, Tkey key, Tval val) {
+            TreapStats::Scope scope(TreapStats::INSERT);
+            //the priority has to be drawn before key is moved
+            unsigned p = new_priority(key);
+            bool inserted;
+            PersistTreap newTreap;
+            newTreap.root = insert_node(move(v), move(key), move(val), p, inserted);
+            return make_pair(move(newTreap), inserted);
+        }
+
+        //The replace functions for modify_node used by erase and update
+        static NodePtr erase_replace(NodePtr& v) {
+            NodePtr left, right;
+            unpack(v, left, right);
+            return join(move(left), move(right));
+        }
+
+        template <typename Fn>
+        static auto update_replace(Fn& fn) {
+            return [&fn](NodePtr& v) {
+                NodePtr left, right;
+                bool own = unpack(v, left, right);
+                NodePtr w = reuse(v, own);
+                w->val = fn(as_const(w->val));
+                w->left = move(left);
+                w->right = move(right);
+                pull(w.get());
+                return w;
+            };
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Bulk build
+        //------------------------------------------------------------------------------------------------------------
+
+        //Builds a treap from elements sorted by key in O(n) time, using the standard stack construction of a
+        //Cartesian tree.  The stack holds the right spine of the treap built so far.  A new element is larger
+        //than everything so far, so it goes at the bottom of the right spine, above every spine node with a
+        //larger priority: those are popped off and become its left subtree.  A popped node will never get a
+        //new child again, so this is when it is pulled.  The nodes are all new and not shared with any other
+        //treap, so they can be modified in place while building.
+        //
+        //If a key appears more than once, the last value wins, the same as inserting the elements in order.
+        template <typename It>
+        static NodePtr build_sorted(It begin, It end) {
+            vector<NodePtr> spine;
+
+            for (It it = begin; it != end; ++it) {
+                if (!spine.empty()) {
+                    Node* last = spine.back().get();
+                    int c = key_compare(it->first, last->key);
+                    if (c == 0) {
+                        //last is still on the spine, so it hasn't been pulled yet
+                        last->val = it->second;
+                        continue;
+                    } else if (c < 0) {
+                        throw invalid_argument("from_sorted needs the elements sorted by key");
+                    }
+                }
+
+                NodePtr n = new_node();
+                n->key = it->first;
+                n->val = it->second;
+                n->p = new_priority(n->key);
+
+                NodePtr popped;
+                while (!spine.empty() && above(n.get(), spine.back().get())) {
+                    popped = move(spine.back());
+                    spine.pop_back();
+                    pull(popped.get());
+                }
+                n->left = move(popped);
+                if (!spine.empty()) {
+                    spine.back()->right = n;
+                }
+                spine.push_back(move(n));
+            }
+
+            if (spine.empty()) {
+                return NodePtr();
+            }
+            //the nodes left on the spine are done too, pull them from the bottom up
+            for (size_t i = spine.size(); i > 0; i--) {
+                pull(spine[i-1].get());
+            }
+            return spine[0];
+        }
+
+        //Builds a treap holding the keys in [begin, end) with default values, for erase_batch.
+        template <typename It>
+        static PersistTreap keys_treap(It begin, It end) {
+            vector<pair<Tkey, Tval>> elements;
+            for (It it = begin; it != end; ++it) {
+                elements.push_back(make_pair(*it, Tval()));
+            }
+            auto by_key = [](const pair<Tkey, Tval>& a, const pair<Tkey, Tval>& b) { return key_less(a.first, b.first); };
+            if (!is_sorted(elements.begin(), elements.end(), by_key)) {
+                sort(elements.begin(), elements.end(), by_key);
+            }
+            //build_sorted skips repeated keys
+            return from_sorted(elements.begin(), elements.end());
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Equality
+        //------------------------------------------------------------------------------------------------------------
+
+        //Compares two subtrees node by node, stopping early at shared subtrees.  Returns false as soon as
+        //the shapes differ, which only means the elements differ if the priorities are canonical.  It goes
+        //down the left children and keeps the pairs of right children still to compare in rest, so a deep
+        //treap doesn't turn into a deep C++ stack, and nothing is allocated until the roots match.
+        static bool same_structure(const Node* a, const Node* b) {
+            vector<pair<const Node*, const Node*>> rest;
+            while (true) {
+                if (a != b) {
+                    if (!a || !b) {
+                        return false;
+                    }
+                    if constexpr (Augment::has_hash) {
+                        if (a->hash != b->hash) {
+                            return false;
+                        }
+                    }
+                    if (key_compare(a->key, b->key) != 0 || a->p != b->p || !(a->val == b->val)) {
+                        return false;
+                    }
+                    rest.emplace_back(a->right.get(), b->right.get());
+                    a = a->left.get();
+                    b = b->left.get();
+                    continue;
+                }
+                if (rest.empty()) {
+                    return true;
+                }
+                tie(a, b) = rest.back();
+                rest.pop_back();
+            }
+        }
+
+        //Compares the in-order sequences of two subtrees, for when their shapes differ.
+        static bool same_elements(const Node* a, const Node* b) {
+            vector<const Node*> sa, sb;
+            while (true) {
+                while (a) {
+                    sa.push_back(a);
+                    a = a->left.get();
+                }
+                while (b) {
+                    sb.push_back(b);
+                    b = b->left.get();
+                }
+                if (sa.empty() || sb.empty()) {
+                    return sa.empty() && sb.empty();
+                }
+                a = sa.back();
+                sa.pop_back();
+                b = sb.back();
+                sb.pop_back();
+                if (key_compare(a->key, b->key) != 0 || !(a->val == b->val)) {
+                    return false;
+                }
+                a = a->right.get();
+                b = b->right.get();
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Debug print
+        //------------------------------------------------------------------------------------------------------------
+
+        static void debug_print_helper(NodePtr v, int indent) {
+            //print the tree via a pre-order traversal.  We print the node, then print
+            //its children at one larger indent level.
+            if (v) {
+                if (indent) {
+                    cout << setw(indent) << " ";
+                }
+                cout << v->key << ":" << v->p << ":" << v->val << endl;
+                debug_print_helper(v->left, indent+4);
+                debug_print_helper(v->right, indent+4);
+            }
+        }
+
+    public:
+
+        //True if versions can be shared between threads (see RefPolicy)
+        static const bool thread_safe = RefPolicy::thread_safe;
+
+        //True if size() and the other order statistics are available (see SizeAugment)
+        static const bool has_size = Augment::has_size;
+
+        //About how many bytes each node takes, for memory accounting
+        static const size_t node_bytes = sizeof(Node) + RefPolicy::node_overhead;
+
+        //A constructor that initializes the treap to the empty treap using the fact that
+        //the root shared_ptr is initialized to nil by the shared_ptr constructor.
+        PersistTreap() {}
+
+        //A constructor to construct a tree consisting of a single node.
+        PersistTreap(Tkey key, Tval val) {
+            root = new_node();
+            root->p = new_priority(key);
+            root->key = move(key);
+            root->val = move(val);
+            pull(root.get());
+        }
+
+        //Builds a treap from a range of (key, value) pairs sorted by key in O(n), which is much faster than
+        //inserting them one at a time.  If a key is repeated the last value is used.  Throws invalid_argument
+        //if the keys aren't sorted.
+        template <typename It>
+        static PersistTreap from_sorted(It begin, It end) {
+            PersistTreap newTreap;
+            newTreap.root = build_sorted(begin, end);
+            return newTreap;
+        }
+
+        //Builds a treap from (key, value) pairs in any order by sorting a copy of them on the ForkJoinPool and
+        //then using from_sorted.  If a key is repeated the last value in the range is used.
+        template <typename It>
+        static PersistTreap from_unsorted(It begin, It end, const Parallel& par = Parallel()) {
+            vector<pair<Tkey, Tval>> elements(begin, end);
+            auto by_key = [](const pair<Tkey, Tval>& a, const pair<Tkey, Tval>& b) { return key_less(a.first, b.first); };
+            if (!is_sorted(elements.begin(), elements.end(), by_key)) {
+                parallel_stable_sort(elements.begin(), elements.end(), by_key, par.spawn_depth);
+            }
+            return from_sorted(elements.begin(), elements.end());
+        }
+
+        //The set operations take their treaps by value.  Passing a treap the caller still uses copies its root
+        //pointer, and the operation clones whatever it changes.  Passing one with move hands the operation its
+        //reference, so the nodes nothing else shares are changed in place (see Transient updates).
+
+        static PersistTreap treap_union(PersistTreap treap1, PersistTreap treap2) {
+            //call union_nodes, unwrapping and then re-wrapping the PersistTree into a NodePtr
+            PersistTreap newTreap;
+            newTreap.root = union_nodes(move(treap1.root), move(treap2.root));
+            return newTreap;
+        }
+
+        static PersistTreap intersection(PersistTreap treap1, PersistTreap treap2) {
+            //call intersect_nodes, unwrapping and then re-wrapping the PersistTree into a NodePtr
+            PersistTreap newTreap;
+            newTreap.root = intersect_nodes(move(treap1.root), move(treap2.root));
+            return newTreap;
+        }
+
+        static PersistTreap difference(PersistTreap treap1, PersistTreap treap2) {
+            //TODO: you write this
+	    PersistTreap newTreap;
+            newTreap.root = difference_nodes(move(treap1.root), move(treap2.root));
+            return newTreap;
+        }
+
+        //Parallel versions of the above.  Nodes are shared between the threads, so the RefPolicy must be
+        //thread safe (SharedRef or IntrusiveRef<true>).
+
+        static PersistTreap treap_union(PersistTreap treap1, PersistTreap treap2, const Parallel& par) {
+            static_assert(RefPolicy::thread_safe, "parallel set operations need a thread safe RefPolicy");
+            PersistTreap newTreap;
+            newTreap.root = set_op_par<UNION>(move(treap1.root), move(treap2.root), par.spawn_depth, par.grain);
+            return newTreap;
+        }
+
+        static PersistTreap intersection(PersistTreap treap1, PersistTreap treap2, const Parallel& par) {
+            static_assert(RefPolicy::thread_safe, "parallel set operations need a thread safe RefPolicy");
+            PersistTreap newTreap;
+            newTreap.root = set_op_par<INTERSECT>(move(treap1.root), move(treap2.root), par.spawn_depth, par.grain);
+            return newTreap;
+        }
+
+        static PersistTreap difference(PersistTreap treap1, PersistTreap treap2, const Parallel& par) {
+            static_assert(RefPolicy::thread_safe, "parallel set operations need a thread safe RefPolicy");
+            PersistTreap newTreap;
+            newTreap.root = set_op_par<DIFFERENCE>(move(treap1.root), move(treap2.root), par.spawn_depth, par.grain);
+            return newTreap;
+        }
+
+        //The union and intersection of all the treaps in [begin, end), as from folding treap_union or
+        //intersection over them left to right: a key in several treaps gets its value from the first of them.
+        //The treaps are combined as a balanced tree (see reduce_all) instead of one after another.  An empty
+        //range gives an empty treap.  Use make_move_iterator to hand over shards that aren't needed afterwards.
+        template <typename It>
+        static PersistTreap union_all(It begin, It end) {
+            vector<NodePtr> roots = take_roots(begin, end);
+            PersistTreap newTreap;
+            if (!roots.empty()) {
+                newTreap.root = reduce_all<UNION>(roots.data(), roots.size(), 0, 0);
+            }
+            return newTreap;
+        }
+
+        template <typename It>
+        static PersistTreap intersect_all(It begin, It end) {
+            vector<NodePtr> roots = take_roots(begin, end);
+            PersistTreap newTreap;
+            if (!roots.empty()) {
+                newTreap.root = reduce_all<INTERSECT>(roots.data(), roots.size(), 0, 0);
+            }
+            return newTreap;
+        }
+
+        //Parallel versions: the top spawn_depth levels of the reduction fork their halves as tasks, and the
+        //operations that combine them are parallel too.  Nodes are shared between the threads, so the RefPolicy
+        //must be thread safe.
+        template <typename It>
+        static PersistTreap union_all(It begin, It end, const Parallel& par) {
+            static_assert(RefPolicy::thread_safe, "parallel set operations need a thread safe RefPolicy");
+            vector<NodePtr> roots = take_roots(begin, end);
+            PersistTreap newTreap;
+            if (!roots.empty()) {
+                newTreap.root = reduce_all<UNION>(roots.data(), roots.size(), par.spawn_depth, par.grain);
+            }
+            return newTreap;
+        }
+
+        template <typename It>
+        static PersistTreap intersect_all(It begin, It end, const Parallel& par) {
+            static_assert(RefPolicy::thread_safe, "parallel set operations need a thread safe RefPolicy");
+            vector<NodePtr> roots = take_roots(begin, end);
+            PersistTreap newTreap;
+            if (!roots.empty()) {
+                newTreap.root = reduce_all<INTERSECT>(roots.data(), roots.size(), par.spawn_depth, par.grain);
+            }
+            return newTreap;
+        }
+
+        //The updates below return a new treap and leave this one alone.  Each also has an overload for an
+        //rvalue treap, as in t = move(t).insert(k, v), which changes the nodes only t holds in place instead
+        //of copying them (see Transient updates).  The key and value of insert are taken by value and moved
+        //into the node.
+
+        //Returns a new treap with key set to val.  If the key already exists its value is replaced.
+        PersistTreap insert(Tkey key, Tval val) const& {
+            return insert_or_assign(move(key), move(val)).first;
+        }
+
+        PersistTreap insert(Tkey key, Tval val) && {
+            return move(*this).insert_or_assign(move(key), move(val)).first;
+        }
+
+        //Like insert, but also returns true if the key was inserted or false if an existing value was replaced.
+        pair<PersistTreap, bool> insert_or_assign(Tkey key, Tval val) const& {
+            return insert_root(root, move(key), move(val));
+        }
+
+        pair<PersistTreap, bool> insert_or_assign(Tkey key, Tval val) && {
+            return insert_root(move(root), move(key), move(val));
+        }
+
+        //Returns a new treap without key.  If key isn't there, the returned treap shares this treap's root.
+        PersistTreap erase(const Tkey& key) const& {
+            TreapStats::Scope scope(TreapStats::ERASE);
+            bool found;
+            PersistTreap newTreap;
+            newTreap.root = modify_node(root, key, erase_replace, found);
+            return newTreap;
+        }
+
+        PersistTreap erase(const Tkey& key) && {
+            TreapStats::Scope scope(TreapStats::ERASE);
+            bool found;
+            PersistTreap newTreap;
+            newTreap.root = modify_node(move(root), key, erase_replace, found);
+            return newTreap;
+        }
+
+        PersistTreap remove(const Tkey& key) const& {
+            return erase(key);
+        }
+
+        PersistTreap remove(const Tkey& key) && {
+            return move(*this).erase(key);
+        }
+
+        //Inserts a batch of (key, value) pairs, in any order, with one union instead of one path copy per
+        //element.  The batch is built with from_unsorted and unioned in front of this treap so its values win,
+        //the same as calling insert for each element in order.  For a batch of k elements into a treap of n
+        //this is O(k log(n/k + 1)).
+        template <typename It>
+        PersistTreap insert_batch(It begin, It end) const& {
+            return treap_union(from_unsorted(begin, end), *this);
+        }
+
+        template <typename It>
+        PersistTreap insert_batch(It begin, It end) && {
+            return treap_union(from_unsorted(begin, end), move(*this));
+        }
+
+        template <typename It>
+        PersistTreap insert_batch(It begin, It end, const Parallel& par) const& {
+            return treap_union(from_unsorted(begin, end, par), *this, par);
+        }
+
+        template <typename It>
+        PersistTreap insert_batch(It begin, It end, const Parallel& par) && {
+            return treap_union(from_unsorted(begin, end, par), move(*this), par);
+        }
+
+        //Removes a batch of keys, in any order, with one difference.
+        template <typename It>
+        PersistTreap erase_batch(It begin, It end) const& {
+            return difference(*this, keys_treap(begin, end));
+        }
+
+        template <typename It>
+        PersistTreap erase_batch(It begin, It end) && {
+            return difference(move(*this), keys_treap(begin, end));
+        }
+
+        template <typename It>
+        PersistTreap erase_batch(It begin, It end, const Parallel& par) const& {
+            return difference(*this, keys_treap(begin, end), par);
+        }
+
+        template <typename It>
+        PersistTreap erase_batch(It begin, It end, const Parallel& par) && {
+            return difference(move(*this), keys_treap(begin, end), par);
+        }
+
+        //Returns a new treap where the value of key is replaced by fn(old value).  If key isn't there, the
+        //returned treap shares this treap's root.
+        template <typename Fn>
+        PersistTreap update(const Tkey& key, Fn fn) const& {
+            TreapStats::Scope scope(TreapStats::UPDATE);
+            bool found;
+            PersistTreap newTreap;
+            newTreap.root = modify_node(root, key, update_replace(fn), found);
+            return newTreap;
+        }
+
+        template <typename Fn>
+        PersistTreap update(const Tkey& key, Fn fn) && {
+            TreapStats::Scope scope(TreapStats::UPDATE);
+            bool found;
+            PersistTreap newTreap;
+            newTreap.root = modify_node(move(root), key, update_replace(fn), found);
+            return newTreap;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Split and concat
+        //------------------------------------------------------------------------------------------------------------
+
+        //These cut and glue whole treaps with a split or a join, so they take O(log n) however many elements end
+        //up on each side, and the subtrees that stay whole are shared with the original.  A treap divided into
+        //per-thread partitions with split_at is put back together with concat, without a union.
+
+    private:
+        static pair<PersistTreap, PersistTreap> wrap(pair<NodePtr, NodePtr> roots) {
+            pair<PersistTreap, PersistTreap> result;
+            result.first.root = move(roots.first);
+            result.second.root = move(roots.second);
+            return result;
+        }
+
+        static pair<PersistTreap, PersistTreap> extract_range_root(NodePtr v, const Tkey& lo, const Tkey& hi) {
+            if (!key_less(lo, hi)) {
+                return wrap(make_pair(NodePtr(), move(v)));
+            }
+            NodePtr below, rest, inside, above;
+            tie(below, rest) = split_keep(move(v), lo);
+            tie(inside, above) = split_keep(move(rest), hi);
+            return wrap(make_pair(move(inside), join(move(below), move(above))));
+        }
+
+    public:
+        //Returns (t1, t2) where t1 holds the elements smaller than key and t2 the rest.
+        pair<PersistTreap, PersistTreap> split_at(const Tkey& key) const& {
+            return wrap(split_keep(root, key));
+        }
+
+        pair<PersistTreap, PersistTreap> split_at(const Tkey& key) && {
+            return wrap(split_keep(move(root), key));
+        }
+
+        //Joins two treaps where every key of treap1 is smaller than every key of treap2.  Throws
+        //invalid_argument if they overlap.
+        static PersistTreap concat(PersistTreap treap1, PersistTreap treap2) {
+            if (treap1.root && treap2.root &&
+                !key_less(max_node(treap1.root.get())->key, min_node(treap2.root.get())->key)) {
+                throw invalid_argument("concat needs every key of the first treap to be smaller");
+            }
+            PersistTreap newTreap;
+            newTreap.root = join(move(treap1.root), move(treap2.root));
+            return newTreap;
+        }
+
+        //Returns (inside, rest) where inside holds the elements with lo <= key < hi and rest the others, with
+        //two splits and a join.
+        pair<PersistTreap, PersistTreap> extract_range(const Tkey& lo, const Tkey& hi) const& {
+            return extract_range_root(root, lo, hi);
+        }
+
+        pair<PersistTreap, PersistTreap> extract_range(const Tkey& lo, const Tkey& hi) && {
+            return extract_range_root(move(root), lo, hi);
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Appending
+        //------------------------------------------------------------------------------------------------------------
+
+        //Keys that arrive in increasing order, like timestamps, always go at the bottom of the right spine.
+        //append is insert for that case: the new node is joined onto the right spine, which skips the split
+        //insert does below the new node.  Path copying means it still copies the spine down to the new node,
+        //which is O(log n).  To append many keys, an Appender keeps the spine itself so appending is O(1)
+        //amortized, with a snapshot of the treap so far whenever it's needed.
+
+    private:
+        //joins a new node onto v, whose keys must all be smaller than key
+        static NodePtr join_leaf(NodePtr v, Tkey key, Tval val) {
+            return join(move(v), PersistTreap(move(key), move(val)).root);
+        }
+
+        static NodePtr append_node(NodePtr v, Tkey key, Tval val) {
+            if (v && !key_less(max_node(v.get())->key, key)) {
+                throw invalid_argument("append needs a key larger than every key in the treap");
+            }
+            return join_leaf(move(v), move(key), move(val));
+        }
+
+    public:
+        //Returns a new treap with key added after every other key.  Throws invalid_argument if key isn't
+        //larger than every key in the treap.
+        PersistTreap append(Tkey key, Tval val) const& {
+            PersistTreap newTreap;
+            newTreap.root = append_node(root, move(key), move(val));
+            return newTreap;
+        }
+
+        PersistTreap append(Tkey key, Tval val) && {
+            PersistTreap newTreap;
+            newTreap.root = append_node(move(root), move(key), move(val));
+            return newTreap;
+        }
+
+        //Builds a treap from keys in increasing order, one key at a time, the same way from_sorted does.  It
+        //holds the right spine of the treap, where each new key goes, so an append never walks down from the
+        //root.  Nodes popped off the spine are final and are pulled then, and the spine is pulled when treap()
+        //takes a snapshot.  The snapshot shares the spine, so the next append copies it (O(log n)) and the ones
+        //after that are O(1) amortized again: with a snapshot every k appends, an append costs O(1 + log(n)/k).
+        //An Appender is not thread safe, but its snapshots are ordinary treaps.
+        class Appender {
+            public:
+                Appender() {}
+
+                //Continues after the elements of t.  Moving in a treap nothing else holds takes over its spine
+                //without copying.
+                explicit Appender(PersistTreap t) {
+                    take_spine(move(t.root));
+                }
+
+                //Adds key after every key so far.  Throws invalid_argument if key isn't larger than all of them.
+                void append(Tkey key, Tval val) {
+                    if (!spine.empty() && !key_less(spine.back()->key, key)) {
+                        throw invalid_argument("Appender needs keys in increasing order");
+                    }
+                    if (shared) {
+                        NodePtr v = move(spine[0]);
+                        spine.clear();
+                        shared = false;
+                        take_spine(move(v));
+                    }
+
+                    NodePtr n = new_node();
+                    n->p = new_priority(key);
+                    n->key = move(key);
+                    n->val = move(val);
+
+                    NodePtr popped;
+                    while (!spine.empty() && above(n.get(), spine.back().get())) {
+                        popped = move(spine.back());
+                        spine.pop_back();
+                        pull(popped.get());
+                    }
+                    n->left = move(popped);
+                    if (!spine.empty()) {
+                        spine.back()->right = n;
+                    }
+                    spine.push_back(move(n));
+                }
+
+                //The treap of everything appended so far
+                PersistTreap treap() {
+                    PersistTreap t;
+                    if (spine.empty()) {
+                        return t;
+                    }
+                    //a shared spine was already pulled and can't be written to anymore
+                    if (Augment::enabled && !shared) {
+                        for (size_t i = spine.size(); i > 0; i--) {
+                            pull(spine[i-1].get());
+                        }
+                    }
+                    shared = true;
+                    t.root = spine[0];
+                    return t;
+                }
+
+                bool empty() const {
+                    return spine.empty();
+                }
+
+            private:
+                vector<NodePtr> spine;
+                //set once treap() has handed out the spine, which then has to be copied before it changes
+                bool shared = false;
+
+                //Makes the right spine of v the Appender's own, reusing the nodes only v holds and copying
+                //the rest.  Unpacking pushes any lazy updates off the spine, since new nodes hang below it.
+                void take_spine(NodePtr v) {
+                    Node* prev = nullptr;
+                    while (v) {
+                        NodePtr left, right;
+                        bool own = unpack(v, left, right);
+                        NodePtr w = reuse(v, own);
+                        w->left = move(left);
+                        v = move(right);
+                        if (prev) {
+                            prev->right = w;
+                        }
+                        prev = w.get();
+                        spine.push_back(move(w));
+                    }
+                }
+        };
+
+        //------------------------------------------------------------------------------------------------------------
+        // Range updates
+        //------------------------------------------------------------------------------------------------------------
+
+        //These need the LazyUpdate policy.
+
+    private:
+        static NodePtr apply_range_root(NodePtr v, const Tkey& lo, const Tkey& hi, const TagType& t) {
+            if (!key_less(lo, hi)) {
+                return v;
+            }
+            NodePtr below, rest, inside, above;
+            tie(below, rest) = split_keep(move(v), lo);
+            tie(inside, above) = split_keep(move(rest), hi);
+            return join(join(move(below), tagged(move(inside), t)), move(above));
+        }
+
+    public:
+        //Returns a new treap where the update t (for example a delta with AddTag) has been applied to the
+        //values of every element with lo <= key < hi, in O(log n): the range is split out, t is applied to
+        //its root and left pending for the rest, and the pieces are joined again.
+        PersistTreap apply_range(const Tkey& lo, const Tkey& hi, const TagType& t) const& {
+            static_assert(Augment::has_lazy, "apply_range needs the LazyUpdate policy");
+            PersistTreap newTreap;
+            newTreap.root = apply_range_root(root, lo, hi, t);
+            return newTreap;
+        }
+
+        PersistTreap apply_range(const Tkey& lo, const Tkey& hi, const TagType& t) && {
+            static_assert(Augment::has_lazy, "apply_range needs the LazyUpdate policy");
+            PersistTreap newTreap;
+            newTreap.root = apply_range_root(move(root), lo, hi, t);
+            return newTreap;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Lookups
+        //------------------------------------------------------------------------------------------------------------
+
+        //These only read, so they walk raw Node pointers and never touch reference counts or allocate.
+        //Each returns nullptr if there is no such element.  The ones returning pointers into nodes aren't
+        //available with LazyUpdate (see get below).
+
+        bool empty() const {
+            return !root;
+        }
+
+        //Returns a pointer to the value of key
+        const Tval* find(const Tkey& key) const {
+            static_assert(!Augment::has_lazy, "find returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            const Node* v = root.get();
+            while (v) {
+                int c = key_compare(key, v->key);
+                if (c == 0) {
+                    return &v->val;
+                }
+                v = c < 0 ? v->left.get() : v->right.get();
+            }
+            return nullptr;
+        }
+
+        bool contains(const Tkey& key) const {
+            return find_node(root.get(), key) != nullptr;
+        }
+
+        //Returns the value of key with the pending updates of LazyUpdate applied, or nullopt if it isn't
+        //there.  Without LazyUpdate this is a copy of *find(key).
+        optional<Tval> get(const Tkey& key) const {
+            TagType above = Tag::identity();
+            const Node* v = root.get();
+            while (v) {
+                int c = key_compare(key, v->key);
+                if (c == 0) {
+                    Tval val = v->val;
+                    Tag::apply(above, val);
+                    return val;
+                }
+                above = tag_below(above, v);
+                v = c < 0 ? v->left.get() : v->right.get();
+            }
+            return nullopt;
+        }
+
+        //Writes find(key) for each key in [begin, end) to out, in order.  A single find waits for a cache miss at
+        //almost every node it visits.  This runs the lookups in groups of 16: each round moves every unfinished
+        //lookup of the group one node down and prefetches that node, so the misses of the group overlap
+        //instead of following one another.  It pays off once the treap is much bigger than the cache.
+        template <typename It, typename OutIt>
+        OutIt find_batch(It begin, It end, OutIt out) const {
+            static_assert(!Augment::has_lazy, "find_batch returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            const size_t width = 16;
+            It keys[width];
+            const Node* cur[width];
+            const Tval* found[width];
+            while (begin != end) {
+                size_t n = 0;
+                for (; n < width && begin != end; ++begin, ++n) {
+                    keys[n] = begin;
+                    cur[n] = root.get();
+                    found[n] = nullptr;
+                }
+                size_t active = n;
+                while (active > 0) {
+                    active = 0;
+                    for (size_t j = 0; j < n; j++) {
+                        const Node* v = cur[j];
+                        if (!v) {
+                            continue;
+                        }
+                        int c = key_compare(*keys[j], v->key);
+                        if (c == 0) {
+                            found[j] = &v->val;
+                            v = nullptr;
+                        } else {
+                            v = c < 0 ? v->left.get() : v->right.get();
+                        }
+                        if (v) {
+                            prefetch(v);
+                            active++;
+                        }
+                        cur[j] = v;
+                    }
+                }
+                out = copy(found, found + n, out);
+            }
+            return out;
+        }
+
+        //Returns the element with the smallest key that is at least key
+        const Entry* lower_bound(const Tkey& key) const {
+            static_assert(!Augment::has_lazy, "lower_bound returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            const Node* v = root.get();
+            const Node* best = nullptr;
+            while (v) {
+                if (key_less(v->key, key)) {
+                    v = v->right.get();
+                } else {
+                    //v is a candidate, but there might be a smaller one to the left
+                    best = v;
+                    v = v->left.get();
+                }
+            }
+            return best;
+        }
+
+        //Returns the element with the smallest key that is larger than key
+        const Entry* upper_bound(const Tkey& key) const {
+            static_assert(!Augment::has_lazy, "upper_bound returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            const Node* v = root.get();
+            const Node* best = nullptr;
+            while (v) {
+                if (key_less(key, v->key)) {
+                    best = v;
+                    v = v->left.get();
+                } else {
+                    v = v->right.get();
+                }
+            }
+            return best;
+        }
+
+        //Returns the element with the smallest key
+        const Entry* min() const {
+            static_assert(!Augment::has_lazy, "min returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            return min_node(root.get());
+        }
+
+        //Returns the element with the largest key
+        const Entry* max() const {
+            static_assert(!Augment::has_lazy, "max returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            return max_node(root.get());
+        }
+
+        //Calls fn(key, val) for each element in order, with the pending updates of LazyUpdate applied to the
+        //values.  Uses an explicit stack of the nodes still to visit, each with the updates pending above it.
+        template <typename Fn>
+        void for_each(Fn fn) const {
+            vector<pair<const Node*, TagType>> stack;
+            const Node* v = root.get();
+            TagType above = Tag::identity();
+            while (v || !stack.empty()) {
+                while (v) {
+                    stack.push_back(make_pair(v, above));
+                    above = tag_below(above, v);
+                    v = v->left.get();
+                }
+                v = stack.back().first;
+                above = stack.back().second;
+                stack.pop_back();
+                visit_value(v, above, fn);
+                above = tag_below(above, v);
+                v = v->right.get();
+            }
+        }
+
+        //Like for_each for the elements with lo <= key < hi, skipping subtrees outside the range.
+        template <typename Fn>
+        void for_each_range(const Tkey& lo, const Tkey& hi, Fn fn) const {
+            vector<pair<const Node*, TagType>> stack;
+            const Node* v = root.get();
+            TagType above = Tag::identity();
+            while (v || !stack.empty()) {
+                //go down the left spine of the part of the subtree that can be in range
+                while (v) {
+                    stack.push_back(make_pair(v, above));
+                    above = tag_below(above, v);
+                    v = key_less(v->key, lo) ? nullptr : v->left.get();
+                }
+                v = stack.back().first;
+                above = stack.back().second;
+                stack.pop_back();
+                if (!key_less(v->key, hi)) {
+                    return;
+                }
+                if (!key_less(v->key, lo)) {
+                    visit_value(v, above, fn);
+                }
+                above = tag_below(above, v);
+                v = v->right.get();
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Iteration
+        //------------------------------------------------------------------------------------------------------------
+
+        //A bidirectional iterator over the elements in key order.  It holds raw pointers to the path from the
+        //root to the current node, so moving it never touches reference counts.  The path lives in an inline
+        //array and only spills to the heap in a treap deeper than inline_depth, which is very unlikely with
+        //random priorities, so scanning k elements is O(k + log n) with no allocations.  An iterator is only
+        //valid while the treap it came from (or another sharing its nodes) is alive.
+        class const_iterator {
+            public:
+                typedef bidirectional_iterator_tag iterator_category;
+                typedef Entry value_type;
+                typedef ptrdiff_t difference_type;
+                typedef const Entry* pointer;
+                typedef const Entry& reference;
+
+                const_iterator() : root(nullptr), n(0) {}
+
+                reference operator*() const {
+                    return *top();
+                }
+
+                pointer operator->() const {
+                    return top();
+                }
+
+                const_iterator& operator++() {
+                    const Node* v = top();
+                    if (v->right) {
+                        push(v->right.get());
+                        descend_left();
+                    } else {
+                        //go up until we come from a left child
+                        const Node* child;
+                        do {
+                            child = top();
+                            n--;
+                        } while (n > 0 && top()->left.get() != child);
+                    }
+                    return *this;
+                }
+
+                //Decrementing end() gives the largest element
+                const_iterator& operator--() {
+                    if (n == 0) {
+                        push(root);
+                        descend_right();
+                        return *this;
+                    }
+                    const Node* v = top();
+                    if (v->left) {
+                        push(v->left.get());
+                        descend_right();
+                    } else {
+                        const Node* child;
+                        do {
+                            child = top();
+                            n--;
+                        } while (n > 0 && top()->right.get() != child);
+                    }
+                    return *this;
+                }
+
+                const_iterator operator++(int) {
+                    const_iterator old = *this;
+                    ++*this;
+                    return old;
+                }
+
+                const_iterator operator--(int) {
+                    const_iterator old = *this;
+                    --*this;
+                    return old;
+                }
+
+                bool operator==(const const_iterator& other) const {
+                    return current() == other.current();
+                }
+
+                bool operator!=(const const_iterator& other) const {
+                    return current() != other.current();
+                }
+
+            private:
+                friend struct PersistTreap;
+
+                static const size_t inline_depth = 64;
+
+                const Node* root;
+                const Node* small[inline_depth];
+                vector<const Node*> big;
+                //the length of the path, 0 for end()
+                size_t n;
+
+                explicit const_iterator(const Node* r) : root(r), n(0) {}
+
+                const Node* top() const {
+                    return at(n-1);
+                }
+
+                //the node at depth i of the path, the root being at depth 0
+                const Node* at(size_t i) const {
+                    return i < inline_depth ? small[i] : big[i-inline_depth];
+                }
+
+                //an iterator at the node at depth len-1 of the path
+                const_iterator prefix(size_t len) const {
+                    const_iterator it(root);
+                    for (size_t i = 0; i < len; i++) {
+                        it.push(at(i));
+                    }
+                    return it;
+                }
+
+                const Node* current() const {
+                    return n == 0 ? nullptr : top();
+                }
+
+                void push(const Node* v) {
+                    if (n < inline_depth) {
+                        small[n] = v;
+                    } else {
+                        big.resize(n - inline_depth);
+                        big.push_back(v);
+                    }
+                    n++;
+                }
+
+                void descend_left() {
+                    for (const Node* v = top()->left.get(); v; v = v->left.get()) {
+                        push(v);
+                    }
+                }
+
+                void descend_right() {
+                    for (const Node* v = top()->right.get(); v; v = v->right.get()) {
+                        push(v);
+                    }
+                }
+        };
+
+        typedef const_iterator iterator;
+
+        //A range of elements given by two iterators, so it can be used in a range-based for loop
+        struct Range {
+            const_iterator first;
+            const_iterator last;
+
+            const_iterator begin() const {
+                return first;
+            }
+
+            const_iterator end() const {
+                return last;
+            }
+        };
+
+        const_iterator begin() const {
+            static_assert(!Augment::has_lazy, "begin returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            const_iterator it(root.get());
+            if (root) {
+                it.push(root.get());
+                it.descend_left();
+            }
+            return it;
+        }
+
+        const_iterator end() const {
+            return const_iterator(root.get());
+        }
+
+        //Returns an iterator at the element with the smallest key that is at least key, or end().
+        const_iterator seek(const Tkey& key) const {
+            static_assert(!Augment::has_lazy, "seek returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            const_iterator it(root.get());
+            //the path length at the best candidate so far, 0 if there is none
+            size_t best = 0;
+            for (const Node* v = root.get(); v; ) {
+                it.push(v);
+                if (key_less(v->key, key)) {
+                    v = v->right.get();
+                } else {
+                    best = it.n;
+                    v = v->left.get();
+                }
+            }
+            //the path to the best candidate is a prefix of the path followed
+            it.n = best;
+            return it;
+        }
+
+        //Finger search: like seek, but starting from hint, an iterator into this treap, instead of from the
+        //root.  The subtree of a node on hint's path holds every key between the nearest ancestors it hangs
+        //left and right of, so the search climbs hint's path to the first subtree whose range holds key and
+        //descends from there.  In a treap the expected distance from two nodes to their lowest common ancestor
+        //is O(log d) where d is the number of elements between them, so a key d elements away from hint is
+        //found in expected O(log d) instead of O(log n).  This helps scans that jump forward by small steps,
+        //as in it = t.seek_from(it, next_key), on treaps too big for the cache; a small treap stays in the cache
+        //and seek is just as fast there.  (The part of hint's path above the subtree is still copied
+        //into the result, but that is a copy of pointers, not a walk through the nodes.)  If hint is end() or
+        //from another version it does a seek.
+        const_iterator seek_from(const const_iterator& hint, const Tkey& key) const {
+            static_assert(!Augment::has_lazy, "seek_from returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            if (hint.n == 0 || hint.root != root.get()) {
+                return seek(key);
+            }
+            int c = key_compare(key, hint.top()->key);
+            if (c == 0) {
+                return hint;
+            }
+
+            //Climb while key is outside the range of the subtree at depth i.  Going forward (c > 0), the
+            //subtree's range only ends at a parent it is the left child of; going back, at a parent it is the
+            //right child of.  The smallest key at least key is then in the subtree, or is the parent just
+            //found (hint itself is in the subtree when going back).
+            size_t i = hint.n - 1;
+            size_t best = 0;
+            for (; i > 0; i--) {
+                const Node* child = hint.at(i);
+                const Node* parent = hint.at(i-1);
+                if ((c > 0 ? parent->left.get() : parent->right.get()) != child) {
+                    continue;
+                }
+                int pc = key_compare(key, parent->key);
+                if (pc == 0) {
+                    return hint.prefix(i);
+                }
+                if (c > 0 ? pc < 0 : pc > 0) {
+                    if (c > 0) {
+                        best = i;
+                    }
+                    break;
+                }
+            }
+
+            //keep the path above depth i and descend from there the same way seek does
+            const_iterator it = hint.prefix(i);
+            for (const Node* v = hint.at(i); v; ) {
+                it.push(v);
+                if (key_less(v->key, key)) {
+                    v = v->right.get();
+                } else {
+                    best = it.n;
+                    v = v->left.get();
+                }
+            }
+            it.n = best;
+            return it;
+        }
+
+        //Returns an iterator at key, or end() if it isn't there, using seek_from.
+        const_iterator find_from(const const_iterator& hint, const Tkey& key) const {
+            const_iterator it = seek_from(hint, key);
+            if (it.n == 0 || key_less(key, it->key)) {
+                return end();
+            }
+            return it;
+        }
+
+    private:
+        static PersistTreap insert_hint_root(NodePtr v, const const_iterator& hint, Tkey key, Tval val) {
+            if (hint.n == 0 || hint.root != v.get()) {
+                return insert_root(move(v), move(key), move(val)).first;
+            }
+            TreapStats::Scope scope(TreapStats::INSERT);
+            unsigned p = new_priority(key);
+
+            //Climb hint's path to the lowest subtree whose range holds key, the same way seek_from does (a
+            //parent with key is such a subtree), and then on up while the new node would go above the
+            //subtree's parent.  insert_node into the subtree at depth i then gives the right treap.
+            size_t i = hint.n - 1;
+            int c = key_compare(key, hint.top()->key);
+            if (c != 0) {
+                for (; i > 0; i--) {
+                    const Node* child = hint.at(i);
+                    const Node* parent = hint.at(i-1);
+                    if ((c > 0 ? parent->left.get() : parent->right.get()) != child) {
+                        continue;
+                    }
+                    int pc = key_compare(key, parent->key);
+                    if (pc == 0) {
+                        i--;
+                        break;
+                    }
+                    if (c > 0 ? pc < 0 : pc > 0) {
+                        break;
+                    }
+                }
+            }
+            while (i > 0 && above(p, key, hint.at(i-1))) {
+                i--;
+            }
+
+            //clone the path above depth i by following hint's path, with no key comparisons
+            NodePtr result;
+            NodePtr* t = &result;
+            PullStack clones;
+            for (size_t j = 0; j < i; j++) {
+                bool go_left = v->left.get() == hint.at(j+1);
+                NodePtr left, right;
+                bool own = unpack(v, left, right);
+                NodePtr vclone = reuse(v, own);
+                Node* w = vclone.get();
+                *t = move(vclone);
+                clones.push(w);
+
+                if (go_left) {
+                    w->right = move(right);
+                    t = &w->left;
+                    v = move(left);
+
+                } else {
+                    w->left = move(left);
+                    t = &w->right;
+                    v = move(right);
+                }
+            }
+
+            bool inserted;
+            *t = insert_node(move(v), move(key), move(val), p, inserted);
+            clones.pull_all();
+            PersistTreap newTreap;
+            newTreap.root = move(result);
+            return newTreap;
+        }
+
+    public:
+        //insert with a hint, as with std::map: hint is an iterator near where key goes, such as the element key
+        //goes in front of.  The search for key's place starts from hint's path the way seek_from does, so for
+        //a key d elements away from hint it takes expected O(log d) key comparisons instead of O(log n).  The
+        //path above that place is still copied, as in every insert, but by following hint's path without
+        //comparing keys.  If hint is end() or from another version this is insert.
+        PersistTreap insert_hint(const const_iterator& hint, Tkey key, Tval val) const& {
+            return insert_hint_root(root, hint, move(key), move(val));
+        }
+
+        PersistTreap insert_hint(const const_iterator& hint, Tkey key, Tval val) && {
+            return insert_hint_root(move(root), hint, move(key), move(val));
+        }
+
+        //The elements with lo <= key < hi in order
+        Range range(const Tkey& lo, const Tkey& hi) const {
+            if (!key_less(lo, hi)) {
+                return Range{end(), end()};
+            }
+            return Range{seek(lo), seek(hi)};
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Order statistics
+        //------------------------------------------------------------------------------------------------------------
+
+        //These need the SizeAugment policy and take O(log n).
+
+        //The number of elements in the treap
+        size_t size() const {
+            return subtree_size(root.get());
+        }
+
+        //The number of elements with key smaller than key
+        size_t rank(const Tkey& key) const {
+            const Node* v = root.get();
+            size_t r = 0;
+            while (v) {
+                if (key_less(v->key, key)) {
+                    //v and everything to its left is smaller
+                    r += subtree_size(v->left.get()) + 1;
+                    v = v->right.get();
+                } else {
+                    v = v->left.get();
+                }
+            }
+            return r;
+        }
+
+        //Returns the element at index i in sorted order (starting from zero), or nullptr if i >= size()
+        const Entry* select(size_t i) const {
+            static_assert(!Augment::has_lazy, "select returns pointers into nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            const Node* v = root.get();
+            while (v) {
+                size_t left_size = subtree_size(v->left.get());
+                if (i < left_size) {
+                    v = v->left.get();
+                } else if (i == left_size) {
+                    return v;
+                } else {
+                    i -= left_size + 1;
+                    v = v->right.get();
+                }
+            }
+            return nullptr;
+        }
+
+        //The number of elements with lo <= key < hi
+        size_t count_range(const Tkey& lo, const Tkey& hi) const {
+            if (!key_less(lo, hi)) {
+                return 0;
+            }
+            return rank(hi) - rank(lo);
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Range aggregates
+        //------------------------------------------------------------------------------------------------------------
+
+        //These need an Aggregate<Monoid> policy.  They are templates only so that the return type, which doesn't
+        //exist for other policies, is only looked at when they are called.
+
+        //The aggregate of every element in the treap
+        template <typename A = Augment>
+        typename A::monoid::type aggregate() const {
+            static_assert(A::has_aggregate, "aggregate needs an Aggregate policy");
+            typedef typename A::monoid M;
+            return root ? root->agg : M::identity();
+        }
+
+        //The aggregate of the elements with lo <= key < hi, combined in key order.
+        template <typename A = Augment>
+        typename A::monoid::type aggregate(const Tkey& lo, const Tkey& hi) const {
+            static_assert(A::has_aggregate, "aggregate needs an Aggregate policy");
+            typedef typename A::monoid M;
+
+            //First find the topmost node inside the range.  Its left subtree holds the part of the range
+            //above lo and its right subtree the part below hi.
+            const Node* v = root.get();
+            while (v) {
+                if (key_less(v->key, lo)) {
+                    v = v->right.get();
+                } else if (!key_less(v->key, hi)) {
+                    v = v->left.get();
+                } else {
+                    break;
+                }
+            }
+            if (!v) {
+                return M::identity();
+            }
+
+            //Walk down the left subtree towards lo.  Whenever a node is at least lo, it and its whole right
+            //subtree are in the range and come before everything collected so far.
+            typename M::type left_part = M::identity();
+            for (const Node* u = v->left.get(); u; ) {
+                if (key_less(u->key, lo)) {
+                    u = u->right.get();
+                } else {
+                    typename M::type piece = M::lift(u->key, u->val);
+                    if (u->right) {
+                        piece = M::combine(piece, u->right->agg);
+                    }
+                    left_part = M::combine(piece, left_part);
+                    u = u->left.get();
+                }
+            }
+
+            //Symmetrically walk down the right subtree towards hi
+            typename M::type right_part = M::identity();
+            for (const Node* u = v->right.get(); u; ) {
+                if (!key_less(u->key, hi)) {
+                    u = u->left.get();
+                } else {
+                    typename M::type piece = M::lift(u->key, u->val);
+                    if (u->left) {
+                        piece = M::combine(u->left->agg, piece);
+                    }
+                    right_part = M::combine(right_part, piece);
+                    u = u->right.get();
+                }
+            }
+
+            return M::combine(M::combine(left_part, M::lift(v->key, v->val)), right_part);
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Node visiting
+        //------------------------------------------------------------------------------------------------------------
+
+        //Calls fn(id) for each node of the treap in pre-order, where id identifies the node: two versions
+        //share a node exactly when they give the same id.  If fn returns false the children of that node
+        //are skipped, so code that accounts for memory across versions (like VersionedTreap) can stop at
+        //nodes it has already counted.  Uses an explicit stack, so deep treaps are fine.
+        template <typename Fn>
+        void visit_nodes(Fn fn) const {
+            vector<const Node*> stack;
+            if (root) {
+                stack.push_back(root.get());
+            }
+            while (!stack.empty()) {
+                const Node* v = stack.back();
+                stack.pop_back();
+                if (fn(static_cast<const void*>(v))) {
+                    if (v->right) {
+                        stack.push_back(v->right.get());
+                    }
+                    if (v->left) {
+                        stack.push_back(v->left.get());
+                    }
+                }
+            }
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Health report
+        //------------------------------------------------------------------------------------------------------------
+
+        //debug_print is only readable for a few dozen keys.  health() and sharing() summarize the shape of big
+        //treaps instead, walking them with explicit stacks, and can write the result as JSON.
+
+        struct Health {
+            size_t nodes;
+            //the number of nodes on the longest path from the root, 0 for an empty treap
+            size_t height;
+            //depth_histogram[d] is the number of nodes at depth d, where the root has depth 0
+            vector<size_t> depth_histogram;
+            double average_depth;
+            //The average depth of a treap with random priorities, 2(1 + 1/n)H(n) - 4 where H is the harmonic
+            //number.  An average depth well above this (depth_ratio much over 1) means the priorities aren't
+            //random: a bad Priority policy, lots of ties, or keys chosen against HashPriority.
+            double expected_average_depth;
+            double depth_ratio;
+
+            void write_json(ostream& out) const {
+                out << "{\"nodes\":" << nodes << ",\"height\":" << height << ",\"average_depth\":"
+                    << average_depth << ",\"expected_average_depth\":" << expected_average_depth
+                    << ",\"depth_ratio\":" << depth_ratio << ",\"depth_histogram\":[";
+                for (size_t d = 0; d < depth_histogram.size(); d++) {
+                    out << (d ? "," : "") << depth_histogram[d];
+                }
+                out << "]}";
+            }
+        };
+
+        static double expected_average_depth(size_t n) {
+            if (n == 0) {
+                return 0;
+            }
+            double harmonic = 0;
+            for (size_t i = n; i > 0; i--) {
+                harmonic += 1.0 / double(i);
+            }
+            return 2 * (1 + 1.0 / double(n)) * harmonic - 4;
+        }
+
+        //The shape of this treap in O(n)
+        Health health() const {
+            Health h;
+            h.nodes = 0;
+            h.height = 0;
+            size_t total_depth = 0;
+
+            vector<pair<const Node*, size_t>> stack;
+            if (root) {
+                stack.push_back(make_pair(root.get(), 0));
+            }
+            while (!stack.empty()) {
+                const Node* v = stack.back().first;
+                size_t depth = stack.back().second;
+                stack.pop_back();
+                h.nodes++;
+                total_depth += depth;
+                if (depth >= h.depth_histogram.size()) {
+                    h.depth_histogram.resize(depth + 1);
+                    h.height = depth + 1;
+                }
+                h.depth_histogram[depth]++;
+                if (v->left) {
+                    stack.push_back(make_pair(v->left.get(), depth + 1));
+                }
+                if (v->right) {
+                    stack.push_back(make_pair(v->right.get(), depth + 1));
+                }
+            }
+
+            h.average_depth = h.nodes ? double(total_depth) / double(h.nodes) : 0;
+            h.expected_average_depth = expected_average_depth(h.nodes);
+            //for one or two nodes the expectation is tiny, so compare path lengths (depth + 1) instead
+            h.depth_ratio = h.nodes ? (h.average_depth + 1) / (h.expected_average_depth + 1) : 1;
+            return h;
+        }
+
+        struct VersionSharing {
+            //nodes reachable from the version
+            size_t live;
+            //nodes also reachable from another version in the set
+            size_t shared;
+            //nodes only reachable from this version, which is what dropping it would free
+            size_t unique;
+        };
+
+        struct Sharing {
+            size_t versions;
+            //nodes reachable from any of the versions, which is what they take in memory
+            size_t distinct_nodes;
+            //the sum of the live nodes of each version, what they would take with no sharing
+            size_t total_live_nodes;
+            //1 - distinct / total: the fraction of nodes saved by sharing
+            double sharing_ratio;
+            vector<VersionSharing> per_version;
+
+            void write_json(ostream& out) const {
+                out << "{\"versions\":" << versions << ",\"distinct_nodes\":" << distinct_nodes
+                    << ",\"total_live_nodes\":" << total_live_nodes << ",\"sharing_ratio\":" << sharing_ratio
+                    << ",\"per_version\":[";
+                for (size_t i = 0; i < per_version.size(); i++) {
+                    const VersionSharing& v = per_version[i];
+                    out << (i ? "," : "") << "{\"live\":" << v.live << ",\"shared\":" << v.shared
+                        << ",\"unique\":" << v.unique << "}";
+                }
+                out << "]}";
+            }
+        };
+
+        //How much a set of versions (a range of PersistTreaps) share.  This uses the same shadow reference
+        //counts as VersionedTreap: counting each node's referrers among the versions only walks into a node
+        //the first time it is reached, and a version's unique nodes are the ones reachable from its root
+        //through nodes with a single referrer.  That takes time proportional to the distinct nodes, plus the
+        //live nodes of each version without SizeAugment.
+        template <typename It>
+        static Sharing sharing(It begin, It end) {
+            unordered_map<const void*, size_t> counts;
+            for (It it = begin; it != end; ++it) {
+                it->visit_nodes([&counts](const void* id) {
+                    return counts[id]++ == 0;
+                });
+            }
+
+            Sharing result;
+            result.versions = 0;
+            result.distinct_nodes = counts.size();
+            result.total_live_nodes = 0;
+            for (It it = begin; it != end; ++it) {
+                VersionSharing v;
+                v.unique = 0;
+                it->visit_nodes([&counts, &v](const void* id) {
+                    if (counts.find(id)->second == 1) {
+                        v.unique++;
+                        return true;
+                    }
+                    return false;
+                });
+                if constexpr (Augment::has_size) {
+                    v.live = it->size();
+                } else {
+                    v.live = 0;
+                    it->visit_nodes([&v](const void*) {
+                        v.live++;
+                        return true;
+                    });
+                }
+                v.shared = v.live - v.unique;
+                result.versions++;
+                result.total_live_nodes += v.live;
+                result.per_version.push_back(v);
+            }
+            result.sharing_ratio = result.total_live_nodes
+                ? 1 - double(result.distinct_nodes) / double(result.total_live_nodes) : 0;
+            return result;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Snapshots on disk
+        //------------------------------------------------------------------------------------------------------------
+
+        //save writes a version to a file as an array of fixed size records, one per node, in breadth first
+        //order so the top levels of the treap, which every lookup goes through, are packed together.  A
+        //record stores its children as the distance in records to them (always forward in breadth first
+        //order, 0 for none), so the file is position independent.  open_mmap maps such a file read-only and
+        //returns a Mapped view that does lookups and iteration straight on the mapping with no
+        //deserialization.  A Mapped view is read-only, and a heap version can't point into the mapping for the
+        //subtrees it doesn't change: a child is a NodePtr, a reference counted pointer under every RefPolicy,
+        //and split, join, the set operations, and the point updates all move and clone children through it.
+        //A child that could also be an offset into a mapping would need a second case in every one of them
+        //and a check on every step they take.  So to derive new versions call load, which rebuilds the same
+        //treap (same shape and priorities) on the heap in one O(n) pass over the records, and keep the lookups
+        //and scans, which are what a snapshot is mostly opened for, on the mapping.
+        //
+        //Keys and values are written as raw bytes, so they must be trivially copyable, and the file is only
+        //readable on a machine with the same type sizes and byte order.  open_mmap checks the header and the
+        //file size but not the records (that would mean reading the whole file), so only open files written
+        //by save.
+
+        struct Record : Entry {
+            unsigned p;
+            uint32_t left;
+            uint32_t right;
+        };
+
+    private:
+
+        struct FileHeader {
+            char magic[8];
+            //the size of a Record, and the sizes of a key and value, to catch a file saved with other types
+            uint32_t record_size;
+            uint32_t key_size;
+            uint32_t val_size;
+            //a known value to catch a different byte order
+            uint32_t order_mark;
+            uint64_t count;
+            //pad to 64 bytes so the records after it are aligned
+            char unused[32];
+        };
+
+        static_assert(sizeof(FileHeader) == 64, "FileHeader should be 64 bytes");
+
+        static FileHeader file_header(uint64_t count) {
+            FileHeader h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.magic, "PTREAP1", 8);
+            h.record_size = sizeof(Record);
+            h.key_size = sizeof(Tkey);
+            h.val_size = sizeof(Tval);
+            h.order_mark = 0x01020304;
+            h.count = count;
+            return h;
+        }
+
+        static const Node* min_node(const Node* v) {
+            while (v && v->left) {
+                v = v->left.get();
+            }
+            return v;
+        }
+
+        static const Node* max_node(const Node* v) {
+            while (v && v->right) {
+                v = v->right.get();
+            }
+            return v;
+        }
+
+        //Calls fn(key, val) for v with the updates pending above it applied to the value
+        template <typename Fn>
+        static void visit_value(const Node* v, const TagType& above, Fn& fn) {
+            if constexpr (Augment::has_lazy) {
+                Tval val = v->val;
+                Tag::apply(above, val);
+                fn(v->key, static_cast<const Tval&>(val));
+            } else {
+                (void)above;
+                fn(v->key, v->val);
+            }
+        }
+
+        //The node holding key below v, or nullptr
+        static const Node* find_node(const Node* v, const Tkey& key) {
+            while (v) {
+                int c = key_compare(key, v->key);
+                if (c == 0) {
+                    break;
+                }
+                v = c < 0 ? v->left.get() : v->right.get();
+            }
+            return v;
+        }
+
+        //The link to the node holding key below v, or nullptr
+        static const NodePtr* find_ptr(const NodePtr& v, const Tkey& key) {
+            const NodePtr* t = &v;
+            while (*t) {
+                int c = key_compare(key, (*t)->key);
+                if (c == 0) {
+                    break;
+                }
+                t = c < 0 ? &(*t)->left : &(*t)->right;
+            }
+            return *t ? t : nullptr;
+        }
+
+        static void check_trivial() {
+            static_assert(is_trivially_copyable<Tkey>::value && is_trivially_copyable<Tval>::value,
+                          "save and open_mmap need trivially copyable keys and values");
+            static_assert(!Augment::has_lazy, "snapshots and deltas store the values in nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+        }
+
+    public:
+
+        //A read-only view of a snapshot file mapped into memory.  It unmaps the file when destroyed, so the
+        //pointers it returns are only valid while it is alive.
+        class Mapped {
+            public:
+                Mapped() : base(nullptr), bytes(0), records(nullptr), count(0) {}
+
+                Mapped(Mapped&& o) noexcept : base(o.base), bytes(o.bytes), records(o.records), count(o.count) {
+                    o.base = nullptr;
+                    o.bytes = 0;
+                    o.records = nullptr;
+                    o.count = 0;
+                }
+
+                Mapped& operator=(Mapped&& o) noexcept {
+                    Mapped keep(move(o));
+                    swap(base, keep.base);
+                    swap(bytes, keep.bytes);
+                    swap(records, keep.records);
+                    swap(count, keep.count);
+                    return *this;
+                }
+
+                Mapped(const Mapped&) = delete;
+                Mapped& operator=(const Mapped&) = delete;
+
+                ~Mapped() {
+                    if (base) {
+                        munmap(base, bytes);
+                    }
+                }
+
+                bool empty() const {
+                    return count == 0;
+                }
+
+                size_t size() const {
+                    return count;
+                }
+
+                //Returns a pointer to the value of key, or nullptr if it isn't there
+                const Tval* find(const Tkey& key) const {
+                    const Record* v = root();
+                    while (v) {
+                        int c = key_compare(key, v->key);
+                        if (c == 0) {
+                            return &v->val;
+                        }
+                        v = c < 0 ? left(v) : right(v);
+                    }
+                    return nullptr;
+                }
+
+                bool contains(const Tkey& key) const {
+                    return find(key) != nullptr;
+                }
+
+                //Returns the element with the smallest key that is at least key, or nullptr
+                const Entry* lower_bound(const Tkey& key) const {
+                    const Record* v = root();
+                    const Record* best = nullptr;
+                    while (v) {
+                        if (key_less(v->key, key)) {
+                            v = right(v);
+                        } else {
+                            best = v;
+                            v = left(v);
+                        }
+                    }
+                    return best;
+                }
+
+                //Calls fn(entry) for each element with lo <= key < hi in order, using an explicit stack and
+                //skipping subtrees outside the range.
+                template <typename Fn>
+                void for_each_range(const Tkey& lo, const Tkey& hi, Fn fn) const {
+                    vector<const Record*> stack;
+                    const Record* v = root();
+                    while (v || !stack.empty()) {
+                        while (v) {
+                            stack.push_back(v);
+                            v = key_less(v->key, lo) ? nullptr : left(v);
+                        }
+                        v = stack.back();
+                        stack.pop_back();
+                        if (!key_less(v->key, hi)) {
+                            return;
+                        }
+                        if (!key_less(v->key, lo)) {
+                            fn(static_cast<const Entry&>(*v));
+                        }
+                        v = right(v);
+                    }
+                }
+
+                //Calls fn(entry) for each element in order
+                template <typename Fn>
+                void for_each(Fn fn) const {
+                    vector<const Record*> stack;
+                    const Record* v = root();
+                    while (v || !stack.empty()) {
+                        while (v) {
+                            stack.push_back(v);
+                            v = left(v);
+                        }
+                        v = stack.back();
+                        stack.pop_back();
+                        fn(static_cast<const Entry&>(*v));
+                        v = right(v);
+                    }
+                }
+
+                //Rebuilds the snapshot as a PersistTreap on the heap with the same shape and priorities.  In
+                //breadth first order children come after their parents, so going through the records
+                //backwards builds every node after its children.
+                PersistTreap load() const {
+                    vector<NodePtr> built(count);
+                    for (size_t i = count; i > 0; i--) {
+                        const Record& r = records[i-1];
+                        NodePtr w = new_node();
+                        w->key = r.key;
+                        w->val = r.val;
+                        w->p = r.p;
+                        if (r.left > count - i || r.right > count - i) {
+                            throw runtime_error("Mapped::load: corrupt snapshot");
+                        }
+                        if (r.left) {
+                            w->left = move(built[i-1 + r.left]);
+                        }
+                        if (r.right) {
+                            w->right = move(built[i-1 + r.right]);
+                        }
+                        pull(w.get());
+                        built[i-1] = move(w);
+                    }
+                    PersistTreap newTreap;
+                    if (count) {
+                        newTreap.root = move(built[0]);
+                    }
+                    return newTreap;
+                }
+
+            private:
+                friend struct PersistTreap;
+
+                void* base;
+                size_t bytes;
+                const Record* records;
+                size_t count;
+
+                const Record* root() const {
+                    return count ? records : nullptr;
+                }
+
+                static const Record* left(const Record* v) {
+                    return v->left ? v + v->left : nullptr;
+                }
+
+                static const Record* right(const Record* v) {
+                    return v->right ? v + v->right : nullptr;
+                }
+        };
+
+        //Writes this version to path, replacing the file.  Throws system_error if the file can't be written.
+        void save(const string& path) const {
+            check_trivial();
+
+            //number the nodes in breadth first order: order[i] is node i
+            vector<const Node*> order;
+            if (root) {
+                order.push_back(root.get());
+            }
+            for (size_t i = 0; i < order.size(); i++) {
+                if (order[i]->left) {
+                    order.push_back(order[i]->left.get());
+                }
+                if (order[i]->right) {
+                    order.push_back(order[i]->right.get());
+                }
+            }
+            if (order.size() > numeric_limits<uint32_t>::max()) {
+                throw length_error("save supports up to 2^32 - 1 nodes");
+            }
+
+            FILE* f = fopen(path.c_str(), "wb");
+            if (!f) {
+                throw system_error(errno, generic_category(), "save: can't open " + path);
+            }
+            FileHeader h = file_header(order.size());
+            bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+            //the children of node i are the next unnumbered nodes when i is reached, in the same order as
+            //the loop above numbered them
+            size_t next = 1;
+            for (size_t i = 0; i < order.size() && ok; i++) {
+                Record r;
+                memset(&r, 0, sizeof(r));
+                r.key = order[i]->key;
+                r.val = order[i]->val;
+                r.p = order[i]->p;
+                if (order[i]->left) {
+                    r.left = uint32_t(next++ - i);
+                }
+                if (order[i]->right) {
+                    r.right = uint32_t(next++ - i);
+                }
+                ok = fwrite(&r, sizeof(r), 1, f) == 1;
+            }
+
+            if (fclose(f) != 0 || !ok) {
+                throw system_error(errno, generic_category(), "save: can't write " + path);
+            }
+        }
+
+        //Maps a file written by save.  Throws system_error if it can't be opened or mapped, and
+        //runtime_error if it isn't a snapshot of this treap type.
+        static Mapped open_mmap(const string& path) {
+            check_trivial();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw system_error(errno, generic_category(), "open_mmap: can't open " + path);
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                int err = errno;
+                ::close(fd);
+                throw system_error(err, generic_category(), "open_mmap: can't stat " + path);
+            }
+            size_t bytes = size_t(st.st_size);
+            if (bytes < sizeof(FileHeader)) {
+                ::close(fd);
+                throw runtime_error("open_mmap: " + path + " is not a treap snapshot");
+            }
+            void* base = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            int err = errno;
+            //the mapping stays valid after the file is closed
+            ::close(fd);
+            if (base == MAP_FAILED) {
+                throw system_error(err, generic_category(), "open_mmap: can't map " + path);
+            }
+
+            Mapped m;
+            m.base = base;
+            m.bytes = bytes;
+
+            const FileHeader* h = static_cast<const FileHeader*>(base);
+            FileHeader expected = file_header(h->count);
+            if (memcmp(h, &expected, sizeof(FileHeader)) != 0
+                    || h->count > (bytes - sizeof(FileHeader)) / sizeof(Record)
+                    || bytes != sizeof(FileHeader) + h->count * sizeof(Record)) {
+                throw runtime_error("open_mmap: " + path + " is not a snapshot of this treap type");
+            }
+            m.records = reinterpret_cast<const Record*>(static_cast<const char*>(base) + sizeof(FileHeader));
+            m.count = h->count;
+            return m;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Version deltas
+        //------------------------------------------------------------------------------------------------------------
+
+        //write_delta encodes a version newer that was derived from older by only the nodes created since:
+        //the nodes of newer not shared with older.  Everything else is a subtree of older and is written as
+        //a reference to the key at its root.  apply_delta rebuilds newer on a replica that has its own copy
+        //of older, sharing the subtrees the delta refers to.  So shipping an update costs about as many
+        //records as the update copied, O(log n) for a point update, instead of the whole key set.
+        //
+        //The replica's copy of older must have the same shape, as after load, from_sorted with HashPriority,
+        //or applying the same deltas from the same starting version.  A reference includes the priority of
+        //the node, which apply_delta checks as a cheap test that the replica's copy matches.
+        //
+        //The nodes are written in post-order as they are found, so the delta is streamed without building
+        //it in memory; both sides only keep a stack about as deep as the treap.  After a header, the stream
+        //is a sequence of items, each a tag byte and then:
+        //  - DELTA_NIL: nothing, an empty subtree
+        //  - DELTA_SHARED: key and priority of the root of a subtree of older
+        //  - DELTA_NEW: key, value, and priority of a new node, whose left and right subtrees are the two
+        //    items before it
+        //  - DELTA_END: nothing, ends the delta after the item for the root
+        //Like save, keys and values are raw bytes and must be trivially copyable.
+
+        enum { DELTA_NIL = 0, DELTA_SHARED = 1, DELTA_NEW = 2, DELTA_END = 3 };
+
+        //Writes the delta from older to newer.  Throws runtime_error if the stream fails.
+        static void write_delta(const PersistTreap& older, const PersistTreap& newer, ostream& out) {
+            check_trivial();
+            FileHeader h = file_header(0);
+            memcpy(h.magic, "PTDELTA", 8);
+            out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+            auto put = [&out](const void* data, size_t n) {
+                out.write(static_cast<const char*>(data), n);
+            };
+            auto put_tag = [&put](unsigned char tag) {
+                put(&tag, 1);
+            };
+
+            //post-order with an explicit stack: state says which child of the node to write next
+            vector<pair<const Node*, int>> stack;
+            auto item = [&](const Node* v) {
+                if (!v) {
+                    put_tag(DELTA_NIL);
+                } else if (find_node(older.root.get(), v->key) == v) {
+                    put_tag(DELTA_SHARED);
+                    put(&v->key, sizeof(Tkey));
+                    put(&v->p, sizeof(unsigned));
+                } else {
+                    stack.push_back(make_pair(v, 0));
+                }
+            };
+
+            item(newer.root.get());
+            while (!stack.empty()) {
+                const Node* v = stack.back().first;
+                int state = stack.back().second++;
+                if (state == 0) {
+                    item(v->left.get());
+                } else if (state == 1) {
+                    item(v->right.get());
+                } else {
+                    stack.pop_back();
+                    put_tag(DELTA_NEW);
+                    put(&v->key, sizeof(Tkey));
+                    put(&v->val, sizeof(Tval));
+                    put(&v->p, sizeof(unsigned));
+                }
+            }
+            put_tag(DELTA_END);
+
+            if (!out) {
+                throw runtime_error("write_delta: write failed");
+            }
+        }
+
+        //Reads a delta written against base and returns the version it encodes.  Throws runtime_error if the
+        //stream is truncated or corrupt, or if base doesn't match the version the delta was written against.
+        static PersistTreap apply_delta(const PersistTreap& base, istream& in) {
+            check_trivial();
+            auto get = [&in](void* data, size_t n) {
+                in.read(static_cast<char*>(data), n);
+                if (size_t(in.gcount()) != n) {
+                    throw runtime_error("apply_delta: truncated delta");
+                }
+            };
+
+            FileHeader h, expected = file_header(0);
+            memcpy(expected.magic, "PTDELTA", 8);
+            get(&h, sizeof(h));
+            if (memcmp(&h, &expected, sizeof(h)) != 0) {
+                throw runtime_error("apply_delta: not a delta of this treap type");
+            }
+
+            vector<NodePtr> stack;
+            while (true) {
+                unsigned char tag;
+                get(&tag, 1);
+                if (tag == DELTA_END) {
+                    break;
+                } else if (tag == DELTA_NIL) {
+                    stack.push_back(NodePtr());
+                } else if (tag == DELTA_SHARED) {
+                    Tkey key;
+                    unsigned p;
+                    get(&key, sizeof(Tkey));
+                    get(&p, sizeof(unsigned));
+                    const NodePtr* v = find_ptr(base.root, key);
+                    if (!v || (*v)->p != p) {
+                        throw runtime_error("apply_delta: the base version doesn't match the delta");
+                    }
+                    stack.push_back(*v);
+                } else if (tag == DELTA_NEW) {
+                    if (stack.size() < 2) {
+                        throw runtime_error("apply_delta: corrupt delta");
+                    }
+                    NodePtr w = new_node();
+                    get(&w->key, sizeof(Tkey));
+                    get(&w->val, sizeof(Tval));
+                    get(&w->p, sizeof(unsigned));
+                    w->right = move(stack.back());
+                    stack.pop_back();
+                    w->left = move(stack.back());
+                    stack.pop_back();
+                    pull(w.get());
+                    stack.push_back(move(w));
+                } else {
+                    throw runtime_error("apply_delta: corrupt delta");
+                }
+            }
+            if (stack.size() != 1) {
+                throw runtime_error("apply_delta: corrupt delta");
+            }
+            PersistTreap newTreap;
+            newTreap.root = move(stack.back());
+            return newTreap;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Equality
+        //------------------------------------------------------------------------------------------------------------
+
+        //Two treaps are equal if they hold the same keys with the same values.  Shared subtrees are equal
+        //without looking inside them.  With MerkleHash and a canonical Priority (HashPriority) equal treaps
+        //have the same shape, so different hashes mean the treaps differ.  In that case, comparing
+        //versions that share most of their nodes, or that went through the same HashCons, is close to O(1).
+        bool operator==(const PersistTreap& other) const {
+            static_assert(!Augment::has_lazy, "operator== compares the values in nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            const Node* a = root.get();
+            const Node* b = other.root.get();
+            if (a == b) {
+                return true;
+            } else if (!a || !b) {
+                return false;
+            }
+            if constexpr (Augment::has_size) {
+                if (a->size != b->size) {
+                    return false;
+                }
+            }
+            if (same_structure(a, b)) {
+                return true;
+            }
+            //with random priorities the same elements can be in a different shape
+            return !Priority::canonical && same_elements(a, b);
+        }
+
+        bool operator!=(const PersistTreap& other) const {
+            return !(*this == other);
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Diff
+        //------------------------------------------------------------------------------------------------------------
+
+        enum DiffKind { ADDED, REMOVED, CHANGED };
+
+        //Calls fn(kind, key, old_val, new_val) in key order for every key that is only in newer (ADDED, old_val
+        //is nullptr), only in older (REMOVED, new_val is nullptr), or in both with different values (CHANGED).
+        //
+        //Both treaps are walked in order at the same time, but pending subtrees are only expanded when
+        //needed.  When the same subtree comes up on both sides it is skipped without looking inside.  The
+        //side with the taller pending subtree (the one whose root belongs higher) expands first, so a subtree
+        //shared by both versions comes up on both sides at once.  For a version and one derived from it
+        //by k updates, this takes about O(k log n) instead of O(n).
+        template <typename Fn>
+        static void diff(const PersistTreap& older, const PersistTreap& newer, Fn fn) {
+            static_assert(!Augment::has_lazy, "diff compares the values in nodes, and with LazyUpdate the values in nodes can be out of date: use get or for_each");
+            //Each side keeps a stack of pending items in key order, smallest on top.  An item is a whole
+            //subtree not looked at yet, or a single element whose left subtree is already done.
+            struct Item {
+                const Node* v;
+                bool element;
+            };
+            vector<Item> sa, sb;
+            if (older.root) {
+                sa.push_back(Item{older.root.get(), false});
+            }
+            if (newer.root) {
+                sb.push_back(Item{newer.root.get(), false});
+            }
+
+            auto expand = [](vector<Item>& st) {
+                const Node* v = st.back().v;
+                st.pop_back();
+                if (v->right) {
+                    st.push_back(Item{v->right.get(), false});
+                }
+                st.push_back(Item{v, true});
+                if (v->left) {
+                    st.push_back(Item{v->left.get(), false});
+                }
+            };
+
+            while (!sa.empty() && !sb.empty()) {
+                Item& x = sa.back();
+                Item& y = sb.back();
+
+                if (!x.element && !y.element) {
+                    if (x.v == y.v) {
+                        //shared subtree
+                        sa.pop_back();
+                        sb.pop_back();
+                    } else if (above(x.v, y.v)) {
+                        expand(sa);
+                    } else if (above(y.v, x.v)) {
+                        expand(sb);
+                    } else {
+                        //clones of the same node
+                        expand(sa);
+                        expand(sb);
+                    }
+
+                } else if (!x.element) {
+                    expand(sa);
+
+                } else if (!y.element) {
+                    expand(sb);
+
+                } else if (key_less(x.v->key, y.v->key)) {
+                    const Node* v = x.v;
+                    sa.pop_back();
+                    fn(REMOVED, v->key, &v->val, (const Tval*)nullptr);
+
+                } else if (key_less(y.v->key, x.v->key)) {
+                    const Node* v = y.v;
+                    sb.pop_back();
+                    fn(ADDED, v->key, (const Tval*)nullptr, &v->val);
+
+                } else {
+                    const Node* a = x.v;
+                    const Node* b = y.v;
+                    sa.pop_back();
+                    sb.pop_back();
+                    if (!(a->val == b->val)) {
+                        fn(CHANGED, a->key, &a->val, &b->val);
+                    }
+                }
+            }
+
+            //whatever is left on one side isn't on the other
+            while (!sa.empty()) {
+                if (!sa.back().element) {
+                    expand(sa);
+                } else {
+                    const Node* v = sa.back().v;
+                    sa.pop_back();
+                    fn(REMOVED, v->key, &v->val, (const Tval*)nullptr);
+                }
+            }
+            while (!sb.empty()) {
+                if (!sb.back().element) {
+                    expand(sb);
+                } else {
+                    const Node* v = sb.back().v;
+                    sb.pop_back();
+                    fn(ADDED, v->key, (const Tval*)nullptr, &v->val);
+                }
+            }
+        }
+
+        struct Change {
+            DiffKind kind;
+            Tkey key;
+            //old_val is only meaningful for REMOVED and CHANGED, and new_val for ADDED and CHANGED
+            Tval old_val;
+            Tval new_val;
+        };
+
+        //Same as above, collecting the changes into a vector.
+        static vector<Change> diff(const PersistTreap& older, const PersistTreap& newer) {
+            vector<Change> changes;
+            diff(older, newer, [&changes](DiffKind kind, const Tkey& key, const Tval* old_val, const Tval* new_val) {
+                changes.push_back(Change{kind, key, old_val ? *old_val : Tval(), new_val ? *new_val : Tval()});
+            });
+            return changes;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Hash consing
+        //------------------------------------------------------------------------------------------------------------
+
+        //A HashCons table finds identical subtrees in different versions and makes them share nodes.
+        //intern(t) returns a treap equal to t in which every subtree that is identical (same elements,
+        //priorities, and shape) to one the table has seen before is replaced by that earlier subtree.  With
+        //HashPriority, all versions holding the same set end up as the same nodes, which saves memory and
+        //lets the set operations and operator== skip those subtrees by pointer comparison.
+        //
+        //Needs the MerkleHash augment.  The table holds a reference to every node it has seen; call purge()
+        //now and then to drop the nodes that only the table is keeping alive.  Both walk the nodes with an
+        //explicit stack, like set_op_loop, so deep treaps are fine.
+        struct HashCons {
+            static_assert(Augment::has_hash, "HashCons needs the MerkleHash augment");
+
+            private:
+                unordered_multimap<uint64_t, NodePtr> table;
+
+                static bool identical(const Node* a, const Node* b) {
+                    //the children of both have already been interned, so they can be compared as pointers
+                    return key_compare(a->key, b->key) == 0 && a->val == b->val && a->p == b->p &&
+                           a->left.get() == b->left.get() && a->right.get() == b->right.get();
+                }
+
+                bool interned(const NodePtr& v) const {
+                    auto range = table.equal_range(v->hash);
+                    for (auto it = range.first; it != range.second; ++it) {
+                        if (it->second == v) {
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+
+                //Returns the node in the table identical to w, adding w if there is none
+                NodePtr find_or_add(NodePtr w) {
+                    auto range = table.equal_range(w->hash);
+                    for (auto it = range.first; it != range.second; ++it) {
+                        if (identical(it->second.get(), w.get())) {
+                            return it->second;
+                        }
+                    }
+                    table.emplace(w->hash, w);
+                    return w;
+                }
+
+                //Interns the subtree of v in post-order, so a node is looked up once its children have been
+                //replaced by their interned versions.  As in set_op_loop, a frame either expands a node into its
+                //children or, once their results are on the results stack, combines them.
+                NodePtr intern_node(const NodePtr& v) {
+                    struct Frame {
+                        NodePtr v;
+                        bool combine;
+                    };
+                    vector<Frame> work;
+                    vector<NodePtr> results;
+                    work.push_back(Frame{v, false});
+
+                    while (!work.empty()) {
+                        Frame f = move(work.back());
+                        work.pop_back();
+
+                        if (!f.combine) {
+                            if (!f.v || interned(f.v)) {
+                                //already interned, and so is everything below it
+                                results.push_back(move(f.v));
+                            } else {
+                                work.push_back(Frame{f.v, true});
+                                work.push_back(Frame{f.v->right, false});
+                                work.push_back(Frame{f.v->left, false});
+                            }
+                            continue;
+                        }
+
+                        NodePtr right = move(results.back());
+                        results.pop_back();
+                        NodePtr left = move(results.back());
+                        results.pop_back();
+
+                        //interning the children doesn't change their hashes, so f.v->hash is still the right hash
+                        NodePtr w = move(f.v);
+                        if (left != w->left || right != w->right) {
+                            w = clone(w);
+                            w->left = move(left);
+                            w->right = move(right);
+                            pull(w.get());
+                        }
+                        results.push_back(find_or_add(move(w)));
+                    }
+
+                    return move(results.back());
+                }
+
+                //Takes v out of the table if it is there
+                bool forget(const NodePtr& v) {
+                    auto range = table.equal_range(v->hash);
+                    for (auto it = range.first; it != range.second; ++it) {
+                        if (it->second == v) {
+                            table.erase(it);
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+
+            public:
+                PersistTreap intern(const PersistTreap& t) {
+                    PersistTreap newTreap;
+                    newTreap.root = intern_node(t.root);
+                    return newTreap;
+                }
+
+                //Drops the nodes that are only referenced by the table, in one pass over it.  Dropping a node can
+                //leave its children only referenced by the table, so a dropped node's children are taken off it
+                //(nothing else holds it) and each one left with no reference but the table's and this one goes
+                //on the same worklist.  Taking the children off first also means every node is freed on its
+                //own, however deep the treap.
+                void purge() {
+                    vector<NodePtr> dead;
+                    for (auto it = table.begin(); it != table.end(); ) {
+                        if (it->second.use_count() == 1) {
+                            dead.push_back(move(it->second));
+                            it = table.erase(it);
+                        } else {
+                            ++it;
+                        }
+                    }
+                    while (!dead.empty()) {
+                        NodePtr v = move(dead.back());
+                        dead.pop_back();
+                        NodePtr children[] = {move(v->left), move(v->right)};
+                        for (NodePtr& c : children) {
+                            if (c && c.use_count() == 2 && forget(c)) {
+                                dead.push_back(move(c));
+                            }
+                        }
+                    }
+                }
+
+                //The number of distinct nodes in the table
+                size_t size() const {
+                    return table.size();
+                }
+        };
+
+        void debug_print() {
+            debug_print_helper(root, 0);
+        }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Blocked treap
+//------------------------------------------------------------------------------------------------------------
+
+//PersistBlockTreap is a different node layout for the same idea.  Every node holds a sorted block of up to B
+//elements instead of one, with the keys and values in separate arrays so a search within a block only
+//touches the keys.  The treap is ordered by blocks: everything in the left subtree of a node is smaller than
+//its first key and everything in the right subtree is larger than its last key.  There are about n/B nodes
+//instead of n, so a lookup follows fewer pointers, iteration walks mostly contiguous memory, and there is much
+//less per-node overhead.  The price is that path copying copies whole blocks: a node on the path is cloned
+//with its block even if only its child changed.  A transient update (t = move(t).insert(k, v)) changes the
+//blocks nothing else holds in place instead, like the && overloads of PersistTreap.
+//
+//Insert puts the key into the block whose range it falls in, or into the block where the search ends.  A
+//full block is split in half: the lower half stays where it is and the upper half is inserted again as a new
+//node with a fresh priority, so the treap stays randomly balanced.  Erase removes the node of a block that
+//becomes empty.  Blocks are not merged, so splitting a treap at many keys can leave small blocks behind.
+//
+//Priorities come from Priority::priority of the first key of a new block, so block boundaries depend on
+//the history and the shape is not canonical even with HashPriority.  Keys are ordered by the Compare policy,
+//as in PersistTreap.  Tkey and Tval must be default constructible, since a block holds B of each.
+template <typename Tkey, typename Tval, size_t B = 32, typename Alloc = allocator<char>,
+          typename RefPolicy = SharedRef, typename Priority = RandomPriority, typename Compare = DefaultCompare>
+struct PersistBlockTreap {
+    static_assert(B >= 2, "PersistBlockTreap needs blocks of at least two elements");
+
+    private:
+
+        struct Node;
+        typedef typename allocator_traits<Alloc>::template rebind_alloc<Node> NodeAlloc;
+        typedef typename RefPolicy::template ptr<Node, NodeAlloc> NodePtr;
+
+        struct Node : RefPolicy::Hook {
+            unsigned p;
+            //the number of elements in this block, between 1 and B
+            unsigned n;
+            //the number of elements in this subtree
+            size_t size;
+            NodePtr left;
+            NodePtr right;
+            Tkey keys[B];
+            Tval vals[B];
+       
+            //frees the children without recursing (see Reclaimer)
+            ~Node() {
+                NodeReclaimer<NodePtr, RefPolicy>::release(left, right);
+            }
+        };
+
+        static_assert(is_empty<Alloc>::value, "PersistBlockTreap needs a stateless allocator");
+
+        NodePtr root;
+
+        //------------------------------------------------------------------------------------------------------------
+        // Node creation
+        //------------------------------------------------------------------------------------------------------------
+
+        static NodePtr new_node() {
+            return RefPolicy::template make<Node>(NodeAlloc());
+        }
+
+        //Create a new node with the same block, priority, and children as v.
+        static NodePtr clone(const NodePtr& v) {
+            NodePtr w = new_node();
+            w->p = v->p;
+            w->n = v->n;
+            copy(v->keys, v->keys + v->n, w->keys);
+            copy(v->vals, v->vals + v->n, w->vals);
+            w->left = v->left;
+            w->right = v->right;
+            w->size = v->size;
+            return w;
+        }
+
+        //Create a node holding elements [from, to) of v's block with the given priority and no children.
+        static NodePtr part(const Node* v, unsigned from, unsigned to, unsigned p) {
+            NodePtr w = new_node();
+            w->p = p;
+            w->n = to - from;
+            copy(v->keys + from, v->keys + to, w->keys);
+            copy(v->vals + from, v->vals + to, w->vals);
+            return w;
+        }
+
+        static int key_compare(const Tkey& a, const Tkey& b) {
+            return Compare::compare(a, b);
+        }
+
+        static bool key_less(const Tkey& a, const Tkey& b) {
+            return Compare::compare(a, b) < 0;
+        }
+
+        //Like above in PersistTreap, with ties broken by the first key of the block.
+        static bool above(const Node* a, const Node* b) {
+            return a->p < b->p || (a->p == b->p && key_less(a->keys[0], b->keys[0]));
+        }
+
+        static size_t subtree_size(const Node* v) {
+            return v ? v->size : 0;
+        }
+
+        static void pull(Node* w) {
+            w->size = w->n + subtree_size(w->left.get()) + subtree_size(w->right.get());
+        }
+
+        //The index of the first key in v's block that is at least key, or v->n if there is none.  With a
+        //vectorized BlockSearch for Tkey, a binary search narrows big blocks down to a window of a few
+        //vectors, and the window is counted with vector compares.  Those compare with <, so they are only
+        //used with DefaultCompare.
+        static unsigned block_lower_bound(const Node* v, const Tkey& key) {
+            if constexpr (BlockSearch<Tkey>::vectorized && is_same<Compare, DefaultCompare>::value) {
+                const unsigned window = 4 * BlockSearch<Tkey>::lanes;
+                unsigned first = 0;
+                unsigned len = v->n;
+                while (len > window) {
+                    unsigned half = len / 2;
+                    if (v->keys[first + half] < key) {
+                        first += half + 1;
+                        len -= half + 1;
+                    } else {
+                        len = half;
+                    }
+                }
+                return first + BlockSearch<Tkey>::count_less(v->keys + first, len, key);
+            } else {
+                return unsigned(std::lower_bound(v->keys, v->keys + v->n, key, key_less) - v->keys);
+            }
+        }
+
+        //The first cache lines of v a lookup reads: the block header with the children, and the first keys.
+        static void prefetch_node(const Node* v) {
+            prefetch(v);
+            prefetch(v->keys);
+        }
+
+        //v's own node if this is the only reference to it, so a transient update changes it in place,
+        //otherwise a clone of it.  Either way the caller may move the children out of the result.
+        static NodePtr reuse(NodePtr v) {
+            return RefPolicy::unique(v) ? move(v) : clone(v);
+        }
+
+        //Resets the slots [n, B) of w's block after it shrank in place, so the block doesn't keep the old
+        //keys and values alive.
+        static void clear_tail(Node* w, unsigned old_n) {
+            fill(w->keys + w->n, w->keys + old_n, Tkey());
+            fill(w->vals + w->n, w->vals + old_n, Tval());
+        }
+
+        //As in PersistTreap, the loops below fill in the children of their clones after making them, so
+        //each clone goes on a PullStack and they are all pulled at the end, deepest first.  The block
+        //treap always keeps subtree sizes, so there is nothing to compile away.
+        struct PullStack {
+            static const size_t inline_size = 64;
+            Node* small[inline_size];
+            vector<Node*> big;
+            size_t n = 0;
+
+            void push(Node* v) {
+                if (n < inline_size) {
+                    small[n] = v;
+                } else {
+                    big.push_back(v);
+                }
+                n++;
+            }
+
+            void pull_all() {
+                while (n > 0) {
+                    n--;
+                    pull(n < inline_size ? small[n] : big[n - inline_size]);
+                }
+            }
+        };
+
+        //Puts w in *slot and returns the slot of w's left or right child, where the next node of the path goes
+        static NodePtr* hang(NodePtr* slot, NodePtr w, bool left, PullStack& clones) {
+            Node* n = w.get();
+            *slot = move(w);
+            clones.push(n);
+            return left ? &n->left : &n->right;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Split and join
+        //------------------------------------------------------------------------------------------------------------
+
+        //Returns (t1, t2) where t1 holds the elements smaller than key and t2 the rest.  If key falls inside a
+        //block, the block is cut in two and both halves keep its priority: each half replaces the original
+        //in its own treap, so the heap order still holds.  Like PersistTreap::split_loop, it walks down once
+        //with an output slot for each side: a block that goes right hangs in the right slot, and its left
+        //child, which still has to be split, is where the next block of the right side goes.
+        static pair<NodePtr, NodePtr> split_nodes(NodePtr v, const Tkey& key) {
+            NodePtr t1, t2;
+            NodePtr* l = &t1;
+            NodePtr* r = &t2;
+            PullStack clones;
+
+            while (v) {
+                if (!key_less(v->keys[0], key)) {
+                    //the whole block goes right
+                    NodePtr w = reuse(move(v));
+                    v = move(w->left);
+                    r = hang(r, move(w), true, clones);
+                } else if (key_less(v->keys[v->n - 1], key)) {
+                    //the whole block goes left
+                    NodePtr w = reuse(move(v));
+                    v = move(w->right);
+                    l = hang(l, move(w), false, clones);
+                } else {
+                    unsigned i = block_lower_bound(v.get(), key);
+                    NodePtr hi = part(v.get(), i, v->n, v->p);
+                    NodePtr lo;
+                    if (RefPolicy::unique(v)) {
+                        hi->right = move(v->right);
+                        unsigned old_n = v->n;
+                        v->n = i;
+                        clear_tail(v.get(), old_n);
+                        lo = move(v);
+                    } else {
+                        hi->right = v->right;
+                        lo = part(v.get(), 0, i, v->p);
+                        lo->left = v->left;
+                    }
+                    pull(lo.get());
+                    pull(hi.get());
+                    *l = move(lo);
+                    *r = move(hi);
+                    break;
+                }
+            }
+
+            clones.pull_all();
+            return make_pair(move(t1), move(t2));
+        }
+
+        //Joins two treaps where everything in a is smaller than everything in b.  Like join_loop, the block
+        //with the smaller priority hangs in the output slot, and the join continues in its inner child.
+        static NodePtr join_nodes(NodePtr a, NodePtr b) {
+            NodePtr result;
+            NodePtr* t = &result;
+            PullStack clones;
+
+            while (a && b) {
+                if (above(a.get(), b.get())) {
+                    NodePtr w = reuse(move(a));
+                    a = move(w->right);
+                    t = hang(t, move(w), false, clones);
+                } else {
+                    NodePtr w = reuse(move(b));
+                    b = move(w->left);
+                    t = hang(t, move(w), true, clones);
+                }
+            }
+            *t = a ? move(a) : move(b);
+
+            clones.pull_all();
+            return result;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Point operations
+        //------------------------------------------------------------------------------------------------------------
+
+        //Inserts a new node u with no children, whose block doesn't overlap any block in v, by its priority.
+        //u isn't shared yet, so it is filled in place.
+        static NodePtr insert_block(NodePtr v, NodePtr u) {
+            NodePtr result;
+            NodePtr* t = &result;
+            PullStack clones;
+
+            while (v && !above(u.get(), v.get())) {
+                NodePtr w = reuse(move(v));
+                bool left = key_less(u->keys[0], w->keys[0]);
+                v = move(left ? w->left : w->right);
+                t = hang(t, move(w), left, clones);
+            }
+            tie(u->left, u->right) = split_nodes(move(v), u->keys[0]);
+            pull(u.get());
+            *t = move(u);
+
+            clones.pull_all();
+            return result;
+        }
+
+        //Sets key to val below v.  If the block it goes into was full, the lower half is kept in place and
+        //the upper half is returned in overflow, for the caller to insert again with insert_block.
+        static NodePtr insert_node(NodePtr v, const Tkey& key, const Tval& val, bool& inserted, NodePtr& overflow) {
+            NodePtr result;
+            NodePtr* t = &result;
+            PullStack clones;
+
+            while (v) {
+                if (key_less(key, v->keys[0]) && v->left) {
+                    NodePtr w = reuse(move(v));
+                    v = move(w->left);
+                    t = hang(t, move(w), true, clones);
+                } else if (key_less(v->keys[v->n - 1], key) && v->right) {
+                    NodePtr w = reuse(move(v));
+                    v = move(w->right);
+                    t = hang(t, move(w), false, clones);
+                } else {
+                    break;
+                }
+            }
+
+            if (!v) {
+                NodePtr w = new_node();
+                w->p = Priority::priority(key);
+                w->n = 1;
+                w->keys[0] = key;
+                w->vals[0] = val;
+                pull(w.get());
+                inserted = true;
+                *t = move(w);
+                clones.pull_all();
+                return result;
+            }
+
+            //key belongs in this block
+            unsigned i = block_lower_bound(v.get(), key);
+            NodePtr w;
+            if (i < v->n && key_compare(v->keys[i], key) == 0) {
+                w = reuse(move(v));
+                w->vals[i] = val;
+                inserted = false;
+            } else if (RefPolicy::unique(v) && v->n < B) {
+                //there is room, so shift the rest of the block up in place
+                inserted = true;
+                w = move(v);
+                move_backward(w->keys + i, w->keys + w->n, w->keys + w->n + 1);
+                move_backward(w->vals + i, w->vals + w->n, w->vals + w->n + 1);
+                w->keys[i] = key;
+                w->vals[i] = val;
+                w->n++;
+            } else {
+                inserted = true;
+
+                //build the block with key in it on the stack, one element larger than B when v is full
+                unsigned old_n = v->n;
+                unsigned n = old_n + 1;
+                array<Tkey, B + 1> keys;
+                array<Tval, B + 1> vals;
+                copy(v->keys, v->keys + i, keys.begin());
+                copy(v->vals, v->vals + i, vals.begin());
+                keys[i] = key;
+                vals[i] = val;
+                copy(v->keys + i, v->keys + old_n, keys.begin() + i + 1);
+                copy(v->vals + i, v->vals + old_n, vals.begin() + i + 1);
+
+                if (RefPolicy::unique(v)) {
+                    w = move(v);
+                } else {
+                    w = new_node();
+                    w->p = v->p;
+                    w->left = v->left;
+                    w->right = v->right;
+                    old_n = 0;
+                }
+                unsigned keep = n <= B ? n : n / 2;
+                w->n = keep;
+                copy(keys.begin(), keys.begin() + keep, w->keys);
+                copy(vals.begin(), vals.begin() + keep, w->vals);
+                if (keep < old_n) {
+                    clear_tail(w.get(), old_n);
+                }
+                if (keep < n) {
+                    overflow = new_node();
+                    overflow->p = Priority::priority(keys[keep]);
+                    overflow->n = n - keep;
+                    copy(keys.begin() + keep, keys.begin() + n, overflow->keys);
+                    copy(vals.begin() + keep, vals.begin() + n, overflow->vals);
+                }
+            }
+            pull(w.get());
+            *t = move(w);
+            clones.pull_all();
+            return result;
+        }
+
+        //Removes key below v.  If it isn't there, found is false and v itself is returned.  As in
+        //PersistTreap::modify_node, the key is looked for first, so a miss copies nothing.
+        static NodePtr erase_node(NodePtr v, const Tkey& key, bool& found) {
+            found = false;
+            for (const Node* u = v.get(); u; ) {
+                if (key_less(key, u->keys[0])) {
+                    u = u->left.get();
+                } else if (key_less(u->keys[u->n - 1], key)) {
+                    u = u->right.get();
+                } else {
+                    unsigned i = block_lower_bound(u, key);
+                    found = i < u->n && key_compare(u->keys[i], key) == 0;
+                    break;
+                }
+            }
+            if (!found) {
+                return v;
+            }
+
+            NodePtr result;
+            NodePtr* t = &result;
+            PullStack clones;
+
+            while (true) {
+                if (key_less(key, v->keys[0])) {
+                    NodePtr w = reuse(move(v));
+                    v = move(w->left);
+                    t = hang(t, move(w), true, clones);
+                } else if (key_less(v->keys[v->n - 1], key)) {
+                    NodePtr w = reuse(move(v));
+                    v = move(w->right);
+                    t = hang(t, move(w), false, clones);
+                } else {
+                    break;
+                }
+            }
+
+            unsigned i = block_lower_bound(v.get(), key);
+            bool own = RefPolicy::unique(v);
+            if (v->n == 1) {
+                if (own) {
+                    *t = join_nodes(move(v->left), move(v->right));
+                } else {
+                    *t = join_nodes(v->left, v->right);
+                }
+            } else {
+                NodePtr w;
+                if (own) {
+                    w = move(v);
+                    move(w->keys + i + 1, w->keys + w->n, w->keys + i);
+                    move(w->vals + i + 1, w->vals + w->n, w->vals + i);
+                    w->n--;
+                    clear_tail(w.get(), w->n + 1);
+                } else {
+                    w = part(v.get(), 0, i, v->p);
+                    copy(v->keys + i + 1, v->keys + v->n, w->keys + i);
+                    copy(v->vals + i + 1, v->vals + v->n, w->vals + i);
+                    w->n = v->n - 1;
+                    w->left = v->left;
+                    w->right = v->right;
+                }
+                pull(w.get());
+                *t = move(w);
+            }
+
+            clones.pull_all();
+            return result;
+        }
+
+        //------------------------------------------------------------------------------------------------------------
+        // Bulk build
+        //------------------------------------------------------------------------------------------------------------
+
+        //Packs sorted elements into full blocks and builds the treap of blocks with the same Cartesian tree
+        //stack construction as PersistTreap::build_sorted.
+        template <typename It>
+        static NodePtr build_sorted(It begin, It end) {
+            vector<NodePtr> spine;
+            NodePtr block;
+
+            auto finish_block = [&spine](NodePtr n) {
+                n->p = Priority::priority(n->keys[0]);
+                NodePtr popped;
+                while (!spine.empty() && above(n.get(), spine.back().get())) {
+                    popped = move(spine.back());
+                    spine.pop_back();
+                    pull(popped.get());
+                }
+                n->left = move(popped);
+                if (!spine.empty()) {
+                    spine.back()->right = n;
+                }
+                spine.push_back(move(n));
+            };
+
+            bool any = false;
+            Tkey last = Tkey();
+            for (It it = begin; it != end; ++it) {
+                int c = any ? key_compare(it->first, last) : 1;
+                if (c == 0) {
+                    //the element is the last one added, so it is either in block or the last block on the spine
+                    Node* holder = block ? block.get() : spine.back().get();
+                    holder->vals[holder->n - 1] = it->second;
+                    continue;
+                } else if (c < 0) {
+                    throw invalid_argument("from_sorted needs the elements sorted by key");
+                }
+                any = true;
+                last = it->first;
+
+                if (!block) {
+                    block = new_node();
+                    block->n = 0;
+                }
+                block->keys[block->n] = it->first;
+                block->vals[block->n] = it->second;
+                block->n++;
+                if (block->n == B) {
+                    finish_block(move(block));
+                    block = NodePtr();
+                }
+            }
+            if (block) {
+                finish_block(move(block));
+            }
+
+            if (spine.empty()) {
+                return NodePtr();
+            }
+            for (size_t i = spine.size(); i > 0; i--) {
+                pull(spine[i-1].get());
+            }
+            return spine[0];
+        }
+
+    public:
+
+        PersistBlockTreap() {}
+
+        //Builds a treap from a range of (key, value) pairs sorted by key in O(n), with every block full.  If a
+        //key is repeated the last value is used.  Throws invalid_argument if the keys aren't sorted.
+        template <typename It>
+        static PersistBlockTreap from_sorted(It begin, It end) {
+            PersistBlockTreap newTreap;
+            newTreap.root = build_sorted(begin, end);
+            return newTreap;
+        }
+
     private:
+        static PersistBlockTreap insert_root(NodePtr v, const Tkey& key, const Tval& val) {
+            bool inserted;
+            NodePtr overflow;
+            PersistBlockTreap newTreap;
+            newTreap.root = insert_node(move(v), key, val, inserted, overflow);
+            if (overflow) {
+                //the path down to the block that overflowed is new, so this reuses it in place
+                newTreap.root = insert_block(move(newTreap.root), move(overflow));
+            }
+            return newTreap;
+        }
 
-        struct Node {
-            Tkey key;
-            Tval val;
-            int p;
-            shared_ptr<Node> left;
-            shared_ptr<Node> right;
+        static pair<PersistBlockTreap, PersistBlockTreap> split_root(NodePtr v, const Tkey& key) {
+            pair<PersistBlockTreap, PersistBlockTreap> result;
+            tie(result.first.root, result.second.root) = split_nodes(move(v), key);
+            return result;
+        }
+
+    public:
+        //Returns a new treap with key set to val.  If the key already exists its value is replaced.  As with
+        //PersistTreap, the && overloads (t = move(t).insert(k, v)) change the blocks only this treap holds in
+        //place instead of copying them.
+        PersistBlockTreap insert(const Tkey& key, const Tval& val) const& {
+            return insert_root(root, key, val);
+        }
+
+        PersistBlockTreap insert(const Tkey& key, const Tval& val) && {
+            return insert_root(move(root), key, val);
+        }
+
+        //Returns a new treap without key.  If key isn't there, the returned treap shares this treap's root.
+        PersistBlockTreap erase(const Tkey& key) const& {
+            bool found;
+            PersistBlockTreap newTreap;
+            newTreap.root = erase_node(root, key, found);
+            return newTreap;
+        }
+
+        PersistBlockTreap erase(const Tkey& key) && {
+            bool found;
+            PersistBlockTreap newTreap;
+            newTreap.root = erase_node(move(root), key, found);
+            return newTreap;
+        }
+
+        //Returns (t1, t2) where t1 holds the elements smaller than key and t2 the rest.
+        pair<PersistBlockTreap, PersistBlockTreap> split(const Tkey& key) const& {
+            return split_root(root, key);
+        }
+
+        pair<PersistBlockTreap, PersistBlockTreap> split(const Tkey& key) && {
+            return split_root(move(root), key);
+        }
+
+        //Joins two treaps where every key of treap1 is smaller than every key of treap2.  Throws
+        //invalid_argument if they overlap.
+        static PersistBlockTreap concat(PersistBlockTreap treap1, PersistBlockTreap treap2) {
+            const Node* a = treap1.root.get();
+            const Node* b = treap2.root.get();
+            if (a && b) {
+                while (a->right) {
+                    a = a->right.get();
+                }
+                while (b->left) {
+                    b = b->left.get();
+                }
+                if (!key_less(a->keys[a->n - 1], b->keys[0])) {
+                    throw invalid_argument("concat needs every key of the first treap to be smaller");
+                }
+            }
+            PersistBlockTreap newTreap;
+            newTreap.root = join_nodes(move(treap1.root), move(treap2.root));
+            return newTreap;
+        }
+
+        bool empty() const {
+            return !root;
+        }
+
+        //The number of elements in O(1)
+        size_t size() const {
+            return subtree_size(root.get());
+        }
+
+        //Returns a pointer to the value of key, or nullptr if it isn't there.
+        const Tval* find(const Tkey& key) const {
+            const Node* v = root.get();
+            while (v) {
+                if (key_less(key, v->keys[0])) {
+                    v = v->left.get();
+                } else if (key_less(v->keys[v->n - 1], key)) {
+                    v = v->right.get();
+                } else {
+                    unsigned i = block_lower_bound(v, key);
+                    return key_compare(v->keys[i], key) == 0 ? &v->vals[i] : nullptr;
+                }
+            }
+            return nullptr;
+        }
+
+        bool contains(const Tkey& key) const {
+            return find(key) != nullptr;
+        }
+
+        //Writes find(key) for each key in [begin, end) to out, in order, interleaving the lookups like
+        //PersistTreap::find_batch.
+        template <typename It, typename OutIt>
+        OutIt find_batch(It begin, It end, OutIt out) const {
+            const size_t width = 16;
+            It keys[width];
+            const Node* cur[width];
+            const Tval* found[width];
+            while (begin != end) {
+                size_t n = 0;
+                for (; n < width && begin != end; ++begin, ++n) {
+                    keys[n] = begin;
+                    cur[n] = root.get();
+                    found[n] = nullptr;
+                }
+                size_t active = n;
+                while (active > 0) {
+                    active = 0;
+                    for (size_t j = 0; j < n; j++) {
+                        const Node* v = cur[j];
+                        if (!v) {
+                            continue;
+                        }
+                        const Tkey& key = *keys[j];
+                        if (key_less(key, v->keys[0])) {
+                            v = v->left.get();
+                        } else if (key_less(v->keys[v->n - 1], key)) {
+                            v = v->right.get();
+                        } else {
+                            unsigned i = block_lower_bound(v, key);
+                            found[j] = key_compare(v->keys[i], key) == 0 ? &v->vals[i] : nullptr;
+                            v = nullptr;
+                        }
+                        if (v) {
+                            prefetch_node(v);
+                            active++;
+                        }
+                        cur[j] = v;
+                    }
+                }
+                out = copy(found, found + n, out);
+            }
+            return out;
+        }
+
+        //Calls fn(key, val) for each element with lo <= key < hi in order.  Uses an explicit stack of the
+        //nodes still to visit and skips subtrees outside the range.
+        template <typename Fn>
+        void for_each_range(const Tkey& lo, const Tkey& hi, Fn fn) const {
+            vector<const Node*> stack;
+            const Node* v = root.get();
+            while (v || !stack.empty()) {
+                //go down the left spine of the part of the subtree that can be in range
+                while (v) {
+                    stack.push_back(v);
+                    v = key_less(v->keys[0], lo) ? nullptr : v->left.get();
+                }
+                v = stack.back();
+                stack.pop_back();
+                if (!key_less(v->keys[0], hi)) {
+                    return;
+                }
+                for (unsigned i = block_lower_bound(v, lo); i < v->n && key_less(v->keys[i], hi); i++) {
+                    fn(v->keys[i], v->vals[i]);
+                }
+                v = v->right.get();
+            }
+        }
+
+        //Calls fn(key, val) for each element in order.
+        template <typename Fn>
+        void for_each(Fn fn) const {
+            vector<const Node*> stack;
+            const Node* v = root.get();
+            while (v || !stack.empty()) {
+                while (v) {
+                    stack.push_back(v);
+                    v = v->left.get();
+                }
+                v = stack.back();
+                stack.pop_back();
+                for (unsigned i = 0; i < v->n; i++) {
+                    fn(v->keys[i], v->vals[i]);
+                }
+                v = v->right.get();
+            }
+        }
+
+        //The number of blocks, for comparing the layout with PersistTreap
+        size_t block_count() const {
+            size_t count = 0;
+            vector<const Node*> stack;
+            if (root) {
+                stack.push_back(root.get());
+            }
+            while (!stack.empty()) {
+                const Node* v = stack.back();
+                stack.pop_back();
+                count++;
+                if (v->left) {
+                    stack.push_back(v->left.get());
+                }
+                if (v->right) {
+                    stack.push_back(v->right.get());
+                }
+            }
+            return count;
+        }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Concurrent wrapper
+//------------------------------------------------------------------------------------------------------------
+
+//Every operation returns a new version and leaves the old one alone, so sharing a treap between threads
+//only needs a way to publish the current version.  ConcurrentTreap keeps the current version in an atomic
+//pointer.  Readers take a Snapshot, which is wait-free and doesn't touch any reference counts, and
+//writers build the next version from the current one and install it with a compare-and-swap, retrying
+//if another writer got there first.
+//
+//A replaced version can't be deleted right away since a reader might still be looking at it.  Instead the
+//writer retires it, and it is deleted once every reader that could have seen it is gone.  This uses
+//epoch-based reclamation: a reader announces the global epoch in its slot while it holds a snapshot, a
+//retired version is tagged with the epoch at the time it was replaced, and it is freed once no active
+//reader announced an epoch that old.  All the freeing (and with it the reference count decrements on the
+//old version's nodes) happens on writer threads, never on readers.
+
+//Hands out a small index to each thread that uses a ConcurrentTreap, so that each thread has its own
+//epoch slot.  Indices are given back when the thread exits.
+struct EpochThreadIndex {
+    static const unsigned max_threads = 256;
+
+    static unsigned get() {
+        static thread_local Holder h;
+        return h.index;
+    }
+
+    private:
+        static mutex& lock() {
+            static mutex m;
+            return m;
+        }
+
+        static vector<bool>& used() {
+            static vector<bool> u(max_threads, false);
+            return u;
+        }
+
+        struct Holder {
+            unsigned index;
+
+            Holder() {
+                lock_guard<mutex> guard(lock());
+                vector<bool>& u = used();
+                for (index = 0; index < max_threads && u[index]; index++) {
+                }
+                if (index == max_threads) {
+                    throw runtime_error("too many threads using ConcurrentTreap");
+                }
+                u[index] = true;
+            }
+
+            ~Holder() {
+                lock_guard<mutex> guard(lock());
+                used()[index] = false;
+            }
         };
+};
 
-        shared_ptr<Node> root;
+//Treap is a PersistTreap type whose RefPolicy is thread safe.
+template <typename Treap>
+struct ConcurrentTreap {
+    static_assert(Treap::thread_safe, "ConcurrentTreap needs a thread safe RefPolicy");
 
-        //------------------------------------------------------------------------------------------------------------
-        // Split
-        //------------------------------------------------------------------------------------------------------------
+    private:
 
-        //A recursive implementation of split that is almost a direct translation of the pseudocode.
-        //It uses a tuple (http://www.cplusplus.com/reference/tuple/tuple/) to return multiple values.
-        //It also uses tie (http://www.cplusplus.com/reference/tuple/tie/) to destruct the return tuple.
+        //Each slot is on its own cache line so readers on different threads don't slow each other down.
+        //epoch is 0 when the thread has no snapshot.  nesting is only touched by the owning thread.
+        struct alignas(64) Slot {
+            atomic<uint64_t> epoch;
+            unsigned nesting;
 
-        static tuple<shared_ptr<Node>, shared_ptr<Node>, shared_ptr<Node>> split_rec(shared_ptr<Node> v, Tkey key) {
-            //returns a tuple (t1, t2, a) where t1 is a root of a treap of all elements smaller than key,
-            //t2 is the root of a treap of all elements larger than key, and a is a node equal to key.
+            Slot() : epoch(0), nesting(0) {}
+        };
 
-            if (!v) {
-                return make_tuple(v, v, v);
-            
-            } else if (v->key == key) {
-                //We have found the node to split around: set the output parameters instead of returning them.
-                return make_tuple(v->left, v->right, v);
+        struct Retired {
+            const Treap* version;
+            uint64_t epoch;
+        };
 
-            } else if (key < v->key) {
-                //key is somewhere to the left of v
+        atomic<const Treap*> current;
+        atomic<uint64_t> global_epoch;
+        mutable Slot slots[EpochThreadIndex::max_threads];
 
-                shared_ptr<Node> r1, r2, a;
-                tie(r1, r2, a) = split_rec(v->left, key);
+        mutex retired_lock;
+        vector<Retired> retired;
 
-                //create a clone of v
-                shared_ptr<Node> vclone = make_shared<Node>();
-                vclone->key = v->key;
-                vclone->val = v->val;
-                vclone->p = v->p;
-                vclone->left = r2;
-                vclone->right = v->right;
-
-                return make_tuple(r1, vclone, a);
-                
+        void enter(unsigned i) const {
+            Slot& s = slots[i];
+            if (s.nesting++ == 0) {
+                s.epoch.store(global_epoch.load(memory_order_seq_cst), memory_order_seq_cst);
+            }
+        }
+
+        void leave(unsigned i) const {
+            Slot& s = slots[i];
+            if (--s.nesting == 0) {
+                s.epoch.store(0, memory_order_release);
+            }
+        }
+
+        void retire(const Treap* old) {
+            {
+                lock_guard<mutex> guard(retired_lock);
+                retired.push_back(Retired{old, global_epoch.load(memory_order_seq_cst)});
+            }
+            reclaim();
+        }
+
+    public:
+
+        //A read-only view of the version that was current when the snapshot was taken.  The version stays
+        //alive at least as long as the Snapshot.  Copy the treap out (*snapshot) to keep it longer.
+        class Snapshot {
+            private:
+                const ConcurrentTreap* owner;
+                unsigned index;
+                const Treap* version;
+
+                friend struct ConcurrentTreap;
+
+                Snapshot(const ConcurrentTreap* o, unsigned i, const Treap* v) : owner(o), index(i), version(v) {}
+
+            public:
+                Snapshot(Snapshot&& o) noexcept : owner(o.owner), index(o.index), version(o.version) {
+                    o.owner = nullptr;
+                }
+                Snapshot(const Snapshot&) = delete;
+                Snapshot& operator=(const Snapshot&) = delete;
+
+                ~Snapshot() {
+                    if (owner) {
+                        owner->leave(index);
+                    }
+                }
+
+                const Treap& operator*() const { return *version; }
+                const Treap* operator->() const { return version; }
+        };
+
+        explicit ConcurrentTreap(Treap initial = Treap()) : current(new Treap(move(initial))), global_epoch(1) {}
+
+        ConcurrentTreap(const ConcurrentTreap&) = delete;
+        ConcurrentTreap& operator=(const ConcurrentTreap&) = delete;
+
+        //There must be no snapshots left when the ConcurrentTreap is destroyed.
+        ~ConcurrentTreap() {
+            delete current.load();
+            for (const Retired& r : retired) {
+                delete r.version;
+            }
+        }
+
+        //Wait-free (after the thread's first call): announces the epoch and reads the current version.
+        Snapshot snapshot() const {
+            unsigned i = EpochThreadIndex::get();
+            enter(i);
+            return Snapshot(this, i, current.load(memory_order_seq_cst));
+        }
+
+        //A copy of the current version, which only costs one reference count increment on the root.
+        Treap load() const {
+            return *snapshot();
+        }
+
+        //Replaces the current version with t regardless of what it was.
+        void store(Treap t) {
+            const Treap* next = new Treap(move(t));
+            retire(current.exchange(next, memory_order_seq_cst));
+        }
+
+        //Installs fn(current version) as the new version, calling fn again if another writer installed a
+        //version in between.  fn should be free of side effects since it can run more than once.  Returns
+        //the version that was installed.
+        template <typename Fn>
+        Treap update(Fn fn) {
+            while (true) {
+                Snapshot s = snapshot();
+                const Treap* expected = s.version;
+                const Treap* next = new Treap(fn(*expected));
+                if (current.compare_exchange_strong(expected, next, memory_order_seq_cst)) {
+                    Treap result = *next;
+                    retire(s.version);
+                    return result;
+                }
+                delete next;
+            }
+        }
+
+        //Frees the retired versions that no reader can see anymore.  Writers call this after every retire;
+        //it is public so an idle process can free the last few versions.
+        void reclaim() {
+            vector<const Treap*> to_free;
+            {
+                lock_guard<mutex> guard(retired_lock);
+                if (retired.empty()) {
+                    return;
+                }
+
+                //New readers from now on announce a newer epoch than anything retired so far
+                global_epoch.fetch_add(1, memory_order_seq_cst);
+
+                uint64_t oldest = UINT64_MAX;
+                for (const Slot& slot : slots) {
+                    uint64_t e = slot.epoch.load(memory_order_seq_cst);
+                    if (e != 0 && e < oldest) {
+                        oldest = e;
+                    }
+                }
+
+                //Readers that announced epoch e loaded the current pointer after the epoch was e, so they
+                //can only see versions retired at epoch e or later.
+                size_t kept = 0;
+                for (const Retired& r : retired) {
+                    if (r.epoch < oldest) {
+                        to_free.push_back(r.version);
+                    } else {
+                        retired[kept++] = r;
+                    }
+                }
+                retired.resize(kept);
+            }
+
+            //delete outside the lock, since dropping a big version can take a while
+            for (const Treap* t : to_free) {
+                delete t;
+            }
+        }
+
+        //The number of replaced versions that are waiting for readers to finish
+        size_t pending() {
+            lock_guard<mutex> guard(retired_lock);
+            return retired.size();
+        }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Version history
+//------------------------------------------------------------------------------------------------------------
+
+//VersionedTreap keeps a numbered history of versions of a treap and drops old ones according to a retention
+//policy: at most max_versions versions, none older than max_age, and at most max_bytes of nodes across all
+//the retained versions (0 means no limit).  The newest version is never dropped.
+//
+//For memory accounting it can keep a shadow reference count for every node reachable from a retained
+//version: the number of retained versions whose root it is plus the number of counted nodes that have it
+//as a child.  That is just the node's real reference count restricted to the retained versions.
+//Committing a version increments the count of its root, and only walks into a node the first time its
+//count becomes nonzero, so the cost is the number of new nodes.  Dropping a version does the reverse.
+//The node counts are then always known, and a version's unique nodes are the ones reachable from its root
+//through nodes with a count of one.  The shadow counts are kept when max_bytes is set or track_nodes is
+//true; otherwise stats() builds them when called.
+
+//Treap is a PersistTreap type
+template <typename Treap>
+struct VersionedTreap {
+    typedef chrono::steady_clock Clock;
+
+    struct Retention {
+        size_t max_versions = 0;
+        Clock::duration max_age = Clock::duration::zero();
+        size_t max_bytes = 0;
+        bool track_nodes = false;
+    };
+
+    struct VersionStats {
+        uint64_t version;
+        //nodes reachable from the version
+        size_t live;
+        //nodes also reachable from some other retained version
+        size_t shared;
+        //nodes only reachable from this version, which is what dropping it would free
+        size_t unique;
+    };
+
+    private:
+
+        struct Version {
+            uint64_t number;
+            Clock::time_point time;
+            Treap treap;
+        };
+
+        typedef unordered_map<const void*, size_t> Counts;
+
+        Retention retention;
+        deque<Version> versions;
+        uint64_t next_number;
+        bool tracking;
+        Counts counts;
+
+        static void add_version(Counts& c, const Treap& t) {
+            t.visit_nodes([&c](const void* id) {
+                //only walk into a node the first time it is counted
+                return c[id]++ == 0;
+            });
+        }
+
+        static void remove_version(Counts& c, const Treap& t) {
+            t.visit_nodes([&c](const void* id) {
+                auto it = c.find(id);
+                if (--it->second == 0) {
+                    c.erase(it);
+                    return true;
+                }
+                return false;
+            });
+        }
+
+        void drop_oldest() {
+            if (tracking) {
+                remove_version(counts, versions.front().treap);
+            }
+            versions.pop_front();
+        }
+
+        static size_t live_nodes(const Treap& t) {
+            if constexpr (Treap::has_size) {
+                return t.size();
             } else {
-                //key is somewhere to the right of v
-                shared_ptr<Node> r1, r2, a;
-                tie(r1, r2, a) = split_rec(v->right, key);
+                size_t n = 0;
+                t.visit_nodes([&n](const void*) {
+                    n++;
+                    return true;
+                });
+                return n;
+            }
+        }
 
-                //create a clone of v
-                shared_ptr<Node> vclone = make_shared<Node>();
-                vclone->key = v->key;
-                vclone->val = v->val;
-                vclone->p = v->p;
-                vclone->left = v->left;
-                vclone->right = r1;
+    public:
+
+        explicit VersionedTreap(Retention r = Retention(), Treap initial = Treap())
+            : retention(r), next_number(0), tracking(r.max_bytes != 0 || r.track_nodes) {
+            commit(move(initial));
+        }
 
-                return make_tuple(vclone, r2, a);
+        //Adds t as the newest version and returns its number.  Version numbers start at 0 for the initial
+        //version and go up by one each commit.
+        uint64_t commit(Treap t) {
+            versions.push_back(Version{next_number++, Clock::now(), move(t)});
+            if (tracking) {
+                add_version(counts, versions.back().treap);
             }
+            expire();
+            return versions.back().number;
         }
 
-        //I spent some time trying to make the above recursive split tail-recursive in a way that g++ could optimize.
-        //I eventually succeeded, but the main difficulty is the use of shared_ptrs.  Each shared_ptr has a destructor and the C++
-        //standard says that destructors are run at the end of the block.  The execution of this destructor therefore happens after
-        //the recursive call, making the recursive call NOT a tail-call since there is work after the recursion returns.  I worked
-        //around this with a combination of raw pointers and switching between shared and raw pointers, but it got really messy.
-        //
-        //So instead, I decided it would be much cleaner to manually convert split into a loop.  Essentially manually performing
-        //the tail-call optimization.  Here is the result.
-        
-        static tuple<shared_ptr<Node>, shared_ptr<Node>, shared_ptr<Node>> split_loop(shared_ptr<Node> v, Tkey key) {
-            //result1, result2, and a hold the final result we will return, where result1 is the treap of stuff smaller than key,
-            //result2 is the treap of stuff larger than key, and a is a node potentially equal to key.
-            shared_ptr<Node> result1, result2, a;
+        //Drops the versions the retention policy no longer allows.  commit calls this; call it directly to
+        //drop versions that aged out without a commit.
+        void expire() {
+            Clock::time_point now = Clock::now();
+            while (versions.size() > 1) {
+                const Version& oldest = versions.front();
+                bool too_many = retention.max_versions != 0 && versions.size() > retention.max_versions;
+                bool too_old = retention.max_age != Clock::duration::zero() && now - oldest.time > retention.max_age;
+                bool too_big = retention.max_bytes != 0 && memory_bytes() > retention.max_bytes;
+                if (!too_many && !too_old && !too_big) {
+                    break;
+                }
+                drop_oldest();
+            }
+        }
 
-            //t1 and t2 are pointers to shared_ptrs.  When the recursive version above would return t1 and t2,
-            //instead the loop below will set the shared_ptr into the memory pointed to by t1 or t2.
-            shared_ptr<Node> *t1, *t2;
-           
-            //Initially, t1 should point at result1 and t2 should point at result2
-            t1 = &result1;
-            t2 = &result2;
+        const Treap& current() const {
+            return versions.back().treap;
+        }
+
+        uint64_t current_version() const {
+            return versions.back().number;
+        }
+
+        uint64_t oldest_version() const {
+            return versions.front().number;
+        }
+
+        //The number of retained versions
+        size_t size() const {
+            return versions.size();
+        }
+
+        //Returns the given version, or throws out_of_range if it was dropped or doesn't exist yet.
+        const Treap& at(uint64_t version) const {
+            if (version < oldest_version() || version > current_version()) {
+                throw out_of_range("VersionedTreap::at: version not retained");
+            }
+            //numbers are consecutive, so the version is at a fixed offset from the oldest one
+            return versions[version - oldest_version()].treap;
+        }
+
+        //The number of distinct nodes across all the retained versions
+        size_t distinct_nodes() const {
+            if (tracking) {
+                return counts.size();
+            }
+            Counts c;
+            for (const Version& v : versions) {
+                add_version(c, v.treap);
+            }
+            return c.size();
+        }
+
+        //About how much memory the retained versions hold in nodes
+        size_t memory_bytes() const {
+            return distinct_nodes() * Treap::node_bytes;
+        }
+
+        //Live, shared, and unique node counts for every retained version, oldest first.  This takes time
+        //proportional to the distinct nodes (plus the live ones without SizeAugment).
+        vector<VersionStats> stats() const {
+            Counts built;
+            if (!tracking) {
+                for (const Version& v : versions) {
+                    add_version(built, v.treap);
+                }
+            }
+            const Counts& c = tracking ? counts : built;
+
+            vector<VersionStats> result;
+            for (const Version& v : versions) {
+                size_t unique = 0;
+                v.treap.visit_nodes([&c, &unique](const void* id) {
+                    if (c.find(id)->second == 1) {
+                        unique++;
+                        return true;
+                    }
+                    return false;
+                });
+                size_t live = live_nodes(v.treap);
+                result.push_back(VersionStats{v.number, live, live - unique, unique});
+            }
+            return result;
+        }
+};
+
+//------------------------------------------------------------------------------------------------------------
+// Benchmarks
+//------------------------------------------------------------------------------------------------------------
+
+//Running the program as "persist-treap bench [max_size]" times the core operations on treaps of 1e3 up to
+//max_size elements (default 1e6) in steps of 10, and prints one line per operation with the time and the
+//number of heap allocations per operation (counted with PERSIST_TREAP_STATS=1), and the peak resident set
+//size of the process so far.  Each operation is repeated, doubling the count, until a run takes at least
+//50ms, so small and large treaps get comparable accuracy.  Compare the output before and after a change
+//to catch regressions.
+//
+//The key distributions are
+//  - uniform: n keys uniform in [0, 4n)
+//  - skewed: 4n * u^4 for uniform u in [0, 1), so most keys (and most queries) are packed near 0
+//  - overlap10 and overlap90: for the set operations, a second treap of n keys where 10% or 90% of them
+//    are also in the first
+//  - derived: for the set operations, a second treap that is the first with n/100 inserts, so most
+//    subtrees are shared and the pointer identity shortcuts kick in
+//  - increasing: keys added past the end of the treap, and a scan moving forward with seek and seek_from
+//The drop rows time freeing a whole treap in each Reclaimer mode.
+
+//With PERSIST_TREAP_STATS=1 the program replaces the global operator new to count every call, for the
+//allocations column; otherwise the column shows "-".  A replaced operator new is used by the whole program,
+//not just the bench, so it is only there in a build that asks for the counts.  The replacements are kept
+//out of line so g++ doesn't see malloc and free paired with new and delete at the call sites and warn
+//about it.
+static atomic<size_t> allocation_count(0);
+
+#if PERSIST_TREAP_STATS
+__attribute__((noinline)) void* operator new(size_t n) {
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(n ? n : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+//the nothrow forms (used by get_temporary_buffer in stable_sort) must allocate from the same place
+__attribute__((noinline)) void* operator new(size_t n, const nothrow_t&) noexcept {
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    return malloc(n ? n : 1);
+}
+
+__attribute__((noinline)) void operator delete(void* p, const nothrow_t&) noexcept {
+    free(p);
+}
+#endif
+
+struct TreapBench {
+    typedef PersistTreap<int, int> Treap;
+    typedef Treap::NodePtr NodePtr;
+
+    mt19937_64 rng;
+
+    //lookups store their results here so they aren't optimized away
+    volatile uintptr_t sink;
+
+    TreapBench() : rng(12345), sink(0) {}
+
+    vector<int> keys(size_t n, bool skewed, size_t range) {
+        uniform_real_distribution<double> u(0, 1);
+        vector<int> out(n);
+        for (int& k : out) {
+            double x = u(rng);
+            k = int(range * (skewed ? x * x * x * x : x));
+        }
+        return out;
+    }
+
+    static Treap build(const vector<int>& ks) {
+        vector<pair<int, int>> elements;
+        elements.reserve(ks.size());
+        for (int k : ks) {
+            elements.push_back(make_pair(k, k));
+        }
+        return Treap::from_unsorted(elements.begin(), elements.end());
+    }
+
+    static size_t peak_rss_kb() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return size_t(usage.ru_maxrss);
+    }
+
+    //Prints one line of the table, leaving out the allocations when they aren't counted
+    static void row(const char* name, const char* dist, size_t n, double ns, double allocs) {
+        if (TreapStats::enabled) {
+            printf("%-18s %-10s %9zu %14.1f %12.2f %10.1f\n", name, dist, n, ns, allocs, peak_rss_kb() / 1024.0);
+        } else {
+            printf("%-18s %-10s %9zu %14.1f %12s %10.1f\n", name, dist, n, ns, "-", peak_rss_kb() / 1024.0);
+        }
+        fflush(stdout);
+    }
 
-            //Loop until v is nil
-            while (v) {
+    //Times op(i) for i = 0, 1, ... and prints a line
+    template <typename Op>
+    static void run(const char* name, const char* dist, size_t n, Op op) {
+        for (size_t reps = 1; ; reps *= 2) {
+            size_t allocs = allocation_count.load(memory_order_relaxed);
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < reps; i++) {
+                op(i);
+            }
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+            allocs = allocation_count.load(memory_order_relaxed) - allocs;
+            if (ns >= 50e6 || reps >= (size_t(1) << 24)) {
+                row(name, dist, n, ns / reps, double(allocs) / reps);
+                return;
+            }
+        }
+    }
 
-                if (v->key == key) {
-                    //If v equals key, set the shared_ptr pointed to by t1 to v->left and
-                    //set the shared_ptr pointed to by t2 to v->right.
-                    *t1 = v->left;
-                    *t2 = v->right;
-                    a = v;
-                    break;
+    void point_ops(size_t n, bool skewed) {
+        const char* dist = skewed ? "skewed" : "uniform";
+        Treap t = build(keys(n, skewed, 4 * n));
+        //queries from the same distribution, so skewed queries hit the dense part of the treap
+        vector<int> q = keys(1 << 16, skewed, 4 * n);
+        auto key = [&q](size_t i) { return q[i & (q.size() - 1)]; };
 
-                } else if (key < v->key) {
+        run("split_rec", dist, n, [&](size_t i) { Treap::split_rec(t.root, key(i)); });
+        run("split_loop", dist, n, [&](size_t i) { Treap::split_loop(t.root, key(i)); });
 
-                    //First, create a clone of v
-                    shared_ptr<Node> vclone = make_shared<Node>();
-                    vclone->key = v->key;
-                    vclone->val = v->val;
-                    vclone->p = v->p;
-                    vclone->right = v->right;
+        //join the two halves of a split; the splits are made up front so only the join is timed
+        vector<pair<NodePtr, NodePtr>> halves(256);
+        for (size_t i = 0; i < halves.size(); i++) {
+            NodePtr a;
+            tie(halves[i].first, halves[i].second, a) = Treap::split(t.root, key(i));
+        }
+        run("join_rec", dist, n, [&](size_t i) {
+            const pair<NodePtr, NodePtr>& h = halves[i & 255];
+            Treap::join_rec(h.first, h.second);
+        });
+        run("join_loop", dist, n, [&](size_t i) {
+            const pair<NodePtr, NodePtr>& h = halves[i & 255];
+            Treap::join_loop(h.first, h.second);
+        });
 
-                    //vclone is the root of a treap of elements below v with values
-                    //larger than x, so the vclone shared_ptr should be set in the memory pointed
-                    //to by t2
-                    *t2 = vclone;
+        run("insert", dist, n, [&](size_t i) { t.insert(key(i) | 1, 0); });
+        Treap owned = t;
+        run("insert transient", dist, n, [&](size_t i) { owned = move(owned).insert(key(i) | 1, 0); });
+        owned = Treap();
+        run("remove", dist, n, [&](size_t i) { t.erase(key(i)); });
+        run("update", dist, n, [&](size_t i) { t.update(key(i), [](const int& v) { return v + 1; }); });
+        run("find", dist, n, [&](size_t i) { sink = uintptr_t(t.find(key(i))); });
+        //each op is a batch of 16 lookups
+        const int* found[16];
+        run("find_batch x16", dist, n, [&](size_t i) {
+            size_t from = (16 * i) & (q.size() - 1);
+            t.find_batch(q.begin() + from, q.begin() + from + 16, found);
+            sink = uintptr_t(found[15]);
+        });
+    }
 
-                    //Now set the t2 pointer to point to the memory inside vclone holding the left shared_ptr.
-                    //What will then happen is that the next time *t2 is set to something, that shared_ptr
-                    //will be set into the memory inside the Node struct holding left.
-                    t2 = &vclone->left;
+    void set_ops(size_t n, const char* dist) {
+        vector<int> a = keys(n, false, 4 * n);
+        Treap t1 = build(a);
+        Treap t2;
+        if (strcmp(dist, "derived") == 0) {
+            t2 = t1;
+            for (int k : keys(n / 100 + 1, false, 4 * n)) {
+                t2 = move(t2).insert(k, -k);
+            }
+        } else {
+            double overlap = strcmp(dist, "overlap10") == 0 ? 0.1 : 0.9;
+            vector<int> b = keys(n, false, 4 * n);
+            uniform_real_distribution<double> u(0, 1);
+            for (size_t i = 0; i < n; i++) {
+                if (u(rng) < overlap) {
+                    b[i] = a[i];
+                }
+            }
+            t2 = build(b);
+        }
 
-                    //descend to the left
-                    v = v->left;
+        run("union", dist, n, [&](size_t) { Treap::treap_union(t1, t2); });
+        run("intersection", dist, n, [&](size_t) { Treap::intersection(t1, t2); });
+        run("difference", dist, n, [&](size_t) { Treap::difference(t1, t2); });
+    }
 
-                } else {
-                    //make a clone of v
-                    shared_ptr<Node> vclone = make_shared<Node>();
-                    vclone->key = v->key;
-                    vclone->val = v->val;
-                    vclone->p = v->p;
-                    vclone->left = v->left;
+    //Keys in increasing order, on a treap of the keys 0, 4, ..., 4(n-1): adding keys past the end, and a scan
+    //that moves forward three elements at a time with seek and with seek_from.
+    void sequential(size_t n) {
+        const char* dist = "increasing";
+        vector<int> ks(n);
+        for (size_t i = 0; i < n; i++) {
+            ks[i] = int(4 * i);
+        }
+        Treap t = build(ks);
+        const int end = int(4 * n);
 
-                    //vclone is the root of a treap of stuff below v which is smaller than key, so is set
-                    //into the memory pointed to by t1.
-                    *t1 = vclone;
+        run("insert", dist, n, [&](size_t i) { t.insert(end + int(i), 0); });
+        run("append", dist, n, [&](size_t i) { t.append(end + int(i), 0); });
+        //a fresh Appender on t every 64k appends, so it doesn't grow without bound
+        Treap::Appender appender;
+        int next = end;
+        run("Appender", dist, n, [&](size_t) {
+            if ((next - end) % 65536 == 0) {
+                appender = Treap::Appender(t);
+                next = end;
+            }
+            appender.append(next++, 0);
+        });
+        appender = Treap::Appender();
 
-                    //Set t1 so the next time *t1 is set it becomes the right child of vclone
-                    t1 = &vclone->right;
+        int k = 0;
+        Treap::const_iterator it = t.begin();
+        run("seek +3", dist, n, [&](size_t) {
+            k = k + 12 < end ? k + 12 : 0;
+            it = t.seek(k);
+            sink = uintptr_t(&*it);
+        });
+        k = 0;
+        it = t.begin();
+        run("seek_from +3", dist, n, [&](size_t) {
+            if (k + 12 < end) {
+                k += 12;
+                it = t.seek_from(it, k);
+            } else {
+                k = 0;
+                it = t.begin();
+            }
+            sink = uintptr_t(&*it);
+        });
+    }
 
-                    //descend to the right
-                    v = v->right;
-                }
+    //Times dropping the last reference to a whole treap of n keys in each Reclaimer mode, which is the time the
+    //writer is stalled for.  The treap is built, and the nodes left pending are freed, outside the timing.
+    //The background row is only flat with a core to spare, since otherwise waking the background thread
+    //takes the writer's core away.
+    void drops(size_t n) {
+        const pair<Reclaimer::Mode, const char*> modes[] = {
+            make_pair(Reclaimer::IMMEDIATE, "drop immediate"),
+            make_pair(Reclaimer::DEFERRED, "drop deferred"),
+            make_pair(Reclaimer::BACKGROUND, "drop background"),
+        };
+        const size_t reps = 8;
+        for (const auto& m : modes) {
+            Reclaimer::set_mode(m.first);
+            double ns = 0;
+            size_t allocs = 0;
+            for (size_t i = 0; i < reps; i++) {
+                Treap t = build(keys(n, false, 4 * n));
+                size_t before = allocation_count.load(memory_order_relaxed);
+                auto start = chrono::steady_clock::now();
+                t = Treap();
+                ns += chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+                allocs += allocation_count.load(memory_order_relaxed) - before;
+                Reclaimer::flush();
             }
+            row(m.second, "uniform", n, ns / reps, double(allocs) / reps);
+        }
+        Reclaimer::set_mode(Reclaimer::IMMEDIATE);
+    }
 
-            return make_tuple(result1, result2, a);
+    void all(size_t max_size) {
+        printf("%-18s %-10s %9s %14s %12s %10s\n", "operation", "keys", "n", "ns/op", "allocs/op", "peak MB");
+        for (size_t n = 1000; n <= max_size; n *= 10) {
+            point_ops(n, false);
+            point_ops(n, true);
+            set_ops(n, "overlap10");
+            set_ops(n, "overlap90");
+            set_ops(n, "derived");
+            sequential(n);
+            drops(n);
         }
+    }
+};
 
-        //A helper function allowing you to switch between the recursive or the loop version.
-        static tuple<shared_ptr<Node>, shared_ptr<Node>, shared_ptr<Node>> split(shared_ptr<Node> v, Tkey key) {
-            //return split_rec(v, key);
-            return split_loop(v, key);
+//------------------------------------------------------------------------------------------------------------
+// API tour
+//------------------------------------------------------------------------------------------------------------
+
+//Running the program as "persist-treap tour" runs a check of each feature on small treaps, calling its
+//public entry points and comparing the results with what they should be.  A template member is only
+//compiled where it is called, so the tour is also what makes a plain build type check all of them.  A wrong
+//result throws logic_error.  The demo doesn't run it.
+struct TreapTour {
+    typedef PersistTreap<int, int> Plain;
+
+    static void check(bool ok, const char* what) {
+        if (!ok) {
+            throw logic_error(string("tour: ") + what);
         }
+    }
 
-        //------------------------------------------------------------------------------------------------------------
-        // Join
-        //------------------------------------------------------------------------------------------------------------
+    static void passed(const char* name) {
+        cout << name << ": OK" << endl;
+    }
 
-        static shared_ptr<Node> join(shared_ptr<Node> v1, shared_ptr<Node> v2) {
-            //join takes as input two nodes v1 and v2, where the elements in v1 have smaller keys than elements
-            //in v2.  There is return value is the new root of a treap consisting of the union of the elements
-            //from v1 and v2.
+    template <typename Fn>
+    static bool throws_invalid_argument(Fn fn) {
+        try {
+            fn();
+        } catch (const invalid_argument&) {
+            return true;
+        }
+        return false;
+    }
 
-            //If either v1 or v2 is nil, set the return value to be the other
-            if (!v1) {
-                return v2;
+    //the keys 0, 2, ..., 2(n-1), with the value of k being 10k
+    static vector<pair<int, int>> evens(int n) {
+        vector<pair<int, int>> out;
+        for (int i = 0; i < n; i++) {
+            out.push_back(make_pair(2 * i, 20 * i));
+        }
+        return out;
+    }
 
-            } else if (!v2) {
-                return v1;
+    //the treap of evens(n), inserted one at a time
+    template <typename Treap>
+    static Treap evens_treap(int n) {
+        Treap t;
+        for (const pair<int, int>& e : evens(n)) {
+            t = t.insert(e.first, e.second);
+        }
+        return t;
+    }
 
-            } else if (v1->p < v2->p) {
-                //make a clone of v1 since v1 will become the new root
-                shared_ptr<Node> w = make_shared<Node>();
-                w->key = v1->key;
-                w->val = v1->val;
-                w->p = v1->p;
+    template <typename Treap>
+    static vector<pair<int, int>> elements(const Treap& t) {
+        vector<pair<int, int>> out;
+        t.for_each([&out](const int& k, const int& v) { out.push_back(make_pair(k, v)); });
+        return out;
+    }
 
-                //the left child is unchanged
-                w->left = v1->left;
+    template <typename Treap>
+    static vector<int> keys_of(const Treap& t) {
+        vector<int> out;
+        t.for_each([&out](const int& k, const int&) { out.push_back(k); });
+        return out;
+    }
 
-                //the right child is joined to v2
-                w->right = join(v1->right, v2);
+    //identifies the root node, so a check can tell whether two versions share it
+    template <typename Treap>
+    static const void* root_id(const Treap& t) {
+        const void* root = nullptr;
+        t.visit_nodes([&root](const void* id) {
+            if (!root) {
+                root = id;
+            }
+            return false;
+        });
+        return root;
+    }
 
-                return w;
+    //Priorities that rise with the key, so every treap is a single path, the deepest shape there is
+    struct KeyPriority {
+        static const bool canonical = true;
 
-            } else {
-                //make a clone of v2 since v2 will become the new root
-                shared_ptr<Node> w = make_shared<Node>();
-                w->key = v2->key;
-                w->val = v2->val;
-                w->p = v2->p;
+        template <typename Tkey> static unsigned priority(const Tkey& key) {
+            return unsigned(key);
+        }
+    };
 
-                //the right child is unchanged
-                w->right = v2->right;
+    //split, join, and the set operations on treaps that are paths, so their depth is their size
+    static void deep_treaps() {
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, NoAugment, KeyPriority> Path;
+        //deep enough that the set operations go well past max_recursion into set_op_loop
+        const int n = 100000;
+        vector<pair<int, int>> even, odd, both;
+        for (int i = 0; i < n; i++) {
+            even.push_back(make_pair(2 * i, i));
+            odd.push_back(make_pair(2 * i + 1, i));
+            both.push_back(even.back());
+            both.push_back(odd.back());
+        }
+        Path a = Path::from_sorted(even.begin(), even.end());
+        Path b = Path::from_sorted(odd.begin(), odd.end());
+        Path u = Path::treap_union(a, b);
+        check(elements(u) == both, "deep treap_union");
+        check(elements(Path::intersection(u, a)) == even, "deep intersection");
+        check(elements(Path::difference(u, a)) == odd, "deep difference");
+        pair<Path, Path> halves = u.split_at(n);
+        check(keys_of(halves.first).size() == size_t(n) && elements(Path::concat(halves.first, halves.second)) == both,
+              "deep split and join");
+        passed("deep treaps");
+    }
 
-                //the left child is joined to v1
-                w->left = join(v1, v2->left);
+    //The set operations on the ForkJoinPool give the same treaps as the sequential ones
+    template <typename Treap>
+    static void parallel_set_ops(const char* name) {
+        vector<pair<int, int>> e = evens(5000);
+        Treap a = Treap::from_sorted(e.begin(), e.begin() + 3000);
+        Treap b = Treap::from_sorted(e.begin() + 2000, e.end());
+        Parallel par(4, 64);
+        check(elements(Treap::treap_union(a, b, par)) == e, "parallel treap_union");
+        check(elements(Treap::intersection(a, b, par)) == vector<pair<int, int>>(e.begin() + 2000, e.begin() + 3000),
+              "parallel intersection");
+        check(elements(Treap::difference(a, b, par)) == vector<pair<int, int>>(e.begin(), e.begin() + 2000),
+              "parallel difference");
+        passed(name);
+    }
 
-                return w;
+    //insert, insert_or_assign, erase, remove, and update, next to the set operations they used to go through
+    template <typename Treap>
+    static void point_updates(const char* name) {
+        Treap t = evens_treap<Treap>(20);
+        auto twice = [](const int& v) { return 2 * v; };
+        check(elements(t) == evens(20) && keys_of(Treap(4, 40)) == vector<int>{4}, "insert");
+        check(*t.insert(5, 50).find(5) == 50 && !t.find(5) && *t.insert(4, 41).find(4) == 41, "insert");
+        check(!t.insert_or_assign(4, 41).second && t.insert_or_assign(5, 51).second, "insert_or_assign");
+        check(!t.erase(4).find(4) && keys_of(t.erase(4)).size() == 19 && elements(t.erase(5)) == evens(20), "erase");
+        check(!t.remove(6).find(6) && keys_of(t.remove(6)).size() == 19, "remove");
+        check(*t.update(4, twice).find(4) == 80 && *t.find(4) == 40 && elements(t.update(5, twice)) == evens(20),
+              "update");
+        check(root_id(t.erase(5)) == root_id(t) && root_id(t.update(5, twice)) == root_id(t) &&
+              root_id(Treap(t).erase(5)) == root_id(t), "erase and update of a missing key share the root");
+
+        Treap a, b;
+        for (const pair<int, int>& e : evens(20)) {
+            if (e.first <= 22) {
+                a = a.insert(e.first, e.second);
+            }
+            if (e.first >= 16) {
+                b = b.insert(e.first, e.second + 1);
             }
         }
+        check(keys_of(Treap::treap_union(a, b)).size() == 20 && *Treap::treap_union(a, b).find(16) == 160 &&
+              *Treap::treap_union(b, a).find(16) == 161, "treap_union");
+        check(keys_of(Treap::intersection(a, b)) == vector<int>{16, 18, 20, 22} &&
+              *Treap::intersection(b, a).find(16) == 161, "intersection");
+        check(keys_of(Treap::difference(a, b)) == vector<int>{0, 2, 4, 6, 8, 10, 12, 14}, "difference");
+        passed(name);
+    }
 
-        //The above join is not tail-recursive.  Just like split, it can be made tail-recursive but the
-        //shared_ptr destructors make it complicated.  Instead, in my opinion the best way of optimizing join
-        //is to explicitly convert it to a loop, like I did in split_loop.
+    //Several threads running parallel set operations at once, each joining only its own tasks while the
+    //pool's workers and the other threads steal from it
+    static void forks_from_threads() {
+        vector<pair<int, int>> e = evens(20000);
+        Plain a = Plain::from_sorted(e.begin(), e.begin() + 12000);
+        Plain b = Plain::from_sorted(e.begin() + 8000, e.end());
+        atomic<int> wrong(0);
+        vector<thread> users;
+        for (int i = 0; i < 4; i++) {
+            users.emplace_back([&] {
+                for (int round = 0; round < 3; round++) {
+                    if (elements(Plain::treap_union(a, b, Parallel(6, 64))) != e) {
+                        wrong++;
+                    }
+                }
+            });
+        }
+        for (thread& u : users) {
+            u.join();
+        }
+        check(wrong == 0, "parallel set operations from several threads");
+        passed("ForkJoinPool from several threads");
+    }
 
-        //------------------------------------------------------------------------------------------------------------
-        // Union
-        //------------------------------------------------------------------------------------------------------------
+    //find, get, contains, lower_bound, upper_bound, min, max, and for_each_range
+    static void lookups() {
+        Plain t = evens_treap<Plain>(20);
+        check(*t.find(8) == 80 && !t.find(9) && !Plain().find(8), "find");
+        check(*t.get(8) == 80 && !t.get(9), "get");
+        check(t.contains(8) && !t.contains(9) && !t.contains(-1) && !t.contains(40), "contains");
+        check(t.lower_bound(9)->key == 10 && t.lower_bound(10)->key == 10 && !t.lower_bound(39), "lower_bound");
+        check(t.upper_bound(10)->key == 12 && t.upper_bound(-5)->key == 0 && !t.upper_bound(38), "upper_bound");
+        check(t.min()->key == 0 && t.max()->key == 38 && !Plain().min() && !Plain().max(), "min and max");
+        check(!t.empty() && Plain().empty(), "empty");
+        int sum = 0;
+        t.for_each_range(10, 16, [&sum](const int& k, const int&) { sum += k; });
+        t.for_each_range(16, 10, [&sum](const int& k, const int&) { sum += k; });
+        check(sum == 10 + 12 + 14, "for_each_range");
+        passed("lookups");
+    }
 
-        static shared_ptr<Node> union_helper(shared_ptr<Node> v1, shared_ptr<Node> v2) {
-            //union takes as input two nodes v1 and v2 and returns a node for the left-biased union
+    //size, rank, select, and count_range with SizeAugment
+    static void order_statistics() {
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, SizeAugment> Sized;
+        Sized t = evens_treap<Sized>(20);
+        check(t.size() == 20 && t.erase(4).size() == 19 && t.insert(5, 50).size() == 21 && Sized().size() == 0,
+              "size");
+        check(t.rank(9) == 5 && t.rank(10) == 5 && t.rank(100) == 20 && t.rank(-1) == 0, "rank");
+        check(t.select(5)->key == 10 && t.select(0)->key == 0 && t.select(19)->key == 38 && !t.select(20), "select");
+        check(t.count_range(10, 20) == 5 && t.count_range(11, 11) == 0 && t.count_range(-10, 100) == 20,
+              "count_range");
+        passed("order statistics");
+    }
 
-            //If either v1 or v2 is nil, 
-            if (!v1) {
-                return v2;
+    //aggregate() and aggregate(lo, hi) with the sum, min, and max monoids
+    static void aggregates() {
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, Augments<SizeAugment, Aggregate<SumMonoid<int>>>> Sum;
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, Aggregate<MinMonoid<int>>> Min;
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, Aggregate<MaxMonoid<int>>> Max;
+        Sum s = evens_treap<Sum>(20);
+        check(s.aggregate() == 3800 && s.aggregate(10, 20) == 700 && s.erase(10).aggregate(10, 20) == 600 &&
+              s.aggregate(11, 11) == 0 && s.size() == 20, "SumMonoid");
+        Min m = evens_treap<Min>(20).insert(7, -5);
+        check(m.aggregate() == -5 && m.aggregate(8, 20) == 80 && m.aggregate(41, 50) == numeric_limits<int>::max(),
+              "MinMonoid");
+        Max x = evens_treap<Max>(20).insert(7, 1000);
+        check(x.aggregate() == 1000 && x.aggregate(8, 20) == 180, "MaxMonoid");
+        passed("aggregates");
+    }
 
-            } else if (!v2) {
-                return v1;
+    //ConcurrentTreap: a snapshot stays readable after the version it saw is replaced, and writers on several
+    //threads don't lose each other's updates
+    static void concurrent() {
+        ConcurrentTreap<Plain> c;
+        c.store(Plain(1, 10));
+        Plain t = c.update([](const Plain& v) { return v.insert(2, 20); });
+        {
+            ConcurrentTreap<Plain>::Snapshot s = c.snapshot();
+            c.store(Plain());
+            check(s->contains(2) && elements(*s) == elements(t) && c.load().empty(), "snapshot");
+        }
+        vector<thread> writers;
+        for (int w = 0; w < 4; w++) {
+            writers.emplace_back([&c, w] {
+                for (int i = 0; i < 100; i++) {
+                    c.update([w, i](const Plain& v) { return v.insert(w * 100 + i, i); });
+                }
+            });
+        }
+        for (thread& w : writers) {
+            w.join();
+        }
+        c.reclaim();
+        check(keys_of(c.load()).size() == 400 && c.pending() == 0, "update");
+        passed("ConcurrentTreap");
+    }
 
-            } else if (v1->p < v2->p) {
-                //v1 will become the new root of the union, so split v2 around
-                //v1->key, getting t1, t2, and a as output
-                shared_ptr<Node> t1, t2, a;
-                tie(t1, t2, a) = split(v2, v1->key);
+    //from_sorted and from_unsorted build a treap in O(n) instead of one insert at a time
+    static void bulk_build() {
+        vector<pair<int, int>> e = evens(20000);
+        check(elements(Plain::from_sorted(e.begin(), e.end())) == e && Plain::from_sorted(e.begin(), e.begin()).empty(),
+              "from_sorted");
+        vector<pair<int, int>> repeated{{1, 10}, {1, 11}, {2, 20}};
+        check(*Plain::from_sorted(repeated.begin(), repeated.end()).find(1) == 11, "from_sorted with a repeated key");
+        vector<pair<int, int>> shuffled(e.rbegin(), e.rend());
+        rotate(shuffled.begin(), shuffled.begin() + 7000, shuffled.end());
+        check(elements(Plain::from_unsorted(shuffled.begin(), shuffled.end())) == e, "from_unsorted");
+        check(elements(Plain::from_unsorted(shuffled.begin(), shuffled.end(), Parallel(2))) == e, "from_unsorted par");
+        check(throws_invalid_argument([&] { Plain::from_sorted(shuffled.begin(), shuffled.end()); }),
+              "from_sorted on unsorted keys");
+        passed("bulk build");
+    }
 
-                //create a clone of v1
-                shared_ptr<Node> w = make_shared<Node>();
-                w->key = v1->key;
-                w->val = v1->val;
-                w->p = v1->p;
-                w->left = union_helper(v1->left, t1);
-                w->right = union_helper(v1->right, t2);
-                return w;
+    //insert_batch and erase_batch, sequential and on the ForkJoinPool
+    static void batches() {
+        Plain t = evens_treap<Plain>(20);
+        vector<pair<int, int>> odds{{3, 30}, {1, 10}, {39, 390}, {4, 41}};
+        vector<int> gone{0, 38, 5, 0};
+        Plain in = t.insert_batch(odds.begin(), odds.end());
+        check(keys_of(in).size() == 23 && *in.find(4) == 41 && *in.find(39) == 390, "insert_batch");
+        Plain out = t.erase_batch(gone.begin(), gone.end());
+        check(keys_of(out).size() == 18 && !out.find(0) && !out.find(38), "erase_batch");
+        Parallel par(2);
+        check(elements(t.insert_batch(odds.begin(), odds.end(), par)) == elements(in), "insert_batch par");
+        check(elements(t.erase_batch(gone.begin(), gone.end(), par)) == elements(out), "erase_batch par");
+        passed("batches");
+    }
 
-            } else {
-                //v2 will become the new root of the union, so split v1
-                //around v2->key, getting t1, t2, and a as output
-                shared_ptr<Node> t1, t2, a;
-                tie(t1, t2, a) = split(v1, v2->key);
+    //The priority policies.  With HashPriority the shape only depends on the keys, so treaps built in different
+    //orders have the same shape.
+    static void priorities() {
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, NoAugment, RandPriority> Rand;
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, NoAugment, HashPriority> Hashed;
+        check(elements(evens_treap<Rand>(100)) == evens(100), "RandPriority");
+        vector<pair<int, int>> e = evens(100);
+        Hashed up = evens_treap<Hashed>(100);
+        Hashed down;
+        for (size_t i = e.size(); i > 0; i--) {
+            down = down.insert(e[i-1].first, e[i-1].second);
+        }
+        check(elements(down) == e && up.health().depth_histogram == down.health().depth_histogram, "HashPriority");
+        passed("priorities");
+    }
 
-                //clone of v2
-                shared_ptr<Node> w = make_shared<Node>();
-                w->key = v2->key;
-                if (a) {
-                    //to be left-biased, use the value from v1
-                    w->val = a->val;
-                } else {
-                    //v2->key does not exist in v1, so use v2->val;
-                    w->val = v2->val;
-                }
-                w->p = v2->p;
-                w->left = union_helper(t1, v2->left);
-                w->right = union_helper(t2, v2->right);
-                return w;
-            }
+    //operator== skips identical subtrees, which MerkleHash finds without pointer identity, and HashCons
+    //makes equal versions share their nodes
+    static void hash_consing() {
+        typedef PersistTreap<int, int, allocator<char>, IntrusiveRef<false>, MerkleHash, HashPriority> Hashed;
+        vector<pair<int, int>> e = evens(20);
+        Plain p = evens_treap<Plain>(20);
+        check(p == Plain::from_sorted(e.begin(), e.end()) && p != p.insert(5, 50) && p != p.insert(4, 41), "operator==");
+        Hashed a = Hashed::from_sorted(e.begin(), e.end());
+        Hashed b = evens_treap<Hashed>(20);
+        check(a == b && a != b.insert(5, 50) && a != a.insert(4, 41) && a.erase(4) != a, "MerkleHash operator==");
+        Hashed::HashCons table;
+        Hashed a2 = table.intern(a);
+        Hashed b2 = table.intern(b);
+        check(a2 == b && table.size() == 20 && root_id(a2) == root_id(b2) && root_id(b2) != root_id(b),
+              "HashCons::intern");
+        a = Hashed();
+        b = Hashed();
+        a2 = Hashed();
+        table.purge();
+        check(table.size() == 20, "HashCons::purge keeps nodes in use");
+        b2 = Hashed();
+        table.purge();
+        check(table.size() == 0, "HashCons::purge");
+
+        //the same on treaps that are paths, which would be a recursion as deep as the treap
+        typedef PersistTreap<int, int, allocator<char>, IntrusiveRef<false>, MerkleHash, KeyPriority> Path;
+        vector<pair<int, int>> many = evens(100000);
+        Path p1 = Path::from_sorted(many.begin(), many.end());
+        Path p2 = Path::from_sorted(many.begin(), many.end());
+        check(p1 == p2 && p1 != p2.update(0, [](const int& v) { return v + 1; }), "operator== on a deep treap");
+        {
+            Path::HashCons deep;
+            Path i1 = deep.intern(p1);
+            Path i2 = deep.intern(p2.insert(1, 10).erase(1));
+            check(root_id(i1) == root_id(i2) && deep.size() == many.size(), "HashCons::intern on a deep treap");
+            p1 = Path();
+            p2 = Path();
+            i1 = Path();
+            deep.purge();
+            check(deep.size() == many.size(), "HashCons::purge on a deep treap");
+            i2 = Path();
+            deep.purge();
+            check(deep.size() == 0, "HashCons::purge on a deep treap");
         }
+        passed("hash consing");
+    }
 
-        //------------------------------------------------------------------------------------------------------------
-        // Intersection
-        //------------------------------------------------------------------------------------------------------------
+    //The set operations hand back a subtree both sides share as it is, and diff skips such subtrees
+    static void shared_subtrees() {
+        vector<pair<int, int>> e = evens(1000);
+        Plain t = Plain::from_sorted(e.begin(), e.end());
+        check(root_id(Plain::treap_union(t, t)) == root_id(t) && root_id(Plain::intersection(t, t)) == root_id(t) &&
+              Plain::difference(t, t).empty(), "shared subtrees");
+        Plain u = t.insert(5, 50).erase(6);
+        size_t changes = 0;
+        Plain::diff(t, u, [&changes](Plain::DiffKind, const int&, const int*, const int*) { changes++; });
+        vector<Plain::Change> listed = Plain::diff(t, u);
+        check(changes == 2 && listed.size() == 2 && listed[0].kind == Plain::ADDED && listed[0].key == 5 &&
+              listed[1].kind == Plain::REMOVED && listed[1].key == 6, "diff");
+        listed = Plain::diff(t, t.update(8, [](const int& v) { return v + 1; }));
+        check(listed.size() == 1 && listed[0].kind == Plain::CHANGED && listed[0].old_val == 80 &&
+              listed[0].new_val == 81 && Plain::diff(t, t).empty(), "diff of a changed value");
+        passed("shared subtrees");
+    }
 
-        static shared_ptr<Node> intersect_helper(shared_ptr<Node> v1, shared_ptr<Node> v2) {
-            //intersect_helper takes as input two nodes v1 and v2 and returns a new node for the intersection
-            //of v1 and v2.  The values from v1 are used.
-            
-            if (!v1 || !v2) {
-                return NULL;
-            
-            } else if (v1->p < v2->p) {
-                //v1 is potentially the new root, so split v2 around v1->key
-                shared_ptr<Node> r1, r2, a;
-                tie(r1, r2, a) = split(v2, v1->key);
+    //VersionedTreap keeps the versions the retention policy allows and accounts for what they share
+    static void versions() {
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, SizeAugment> Sized;
+        VersionedTreap<Sized>::Retention r;
+        r.max_versions = 3;
+        r.track_nodes = true;
+        VersionedTreap<Sized> v(r);
+        for (int i = 0; i < 5; i++) {
+            v.commit(v.current().insert(i, i));
+        }
+        v.expire();
+        check(v.size() == 3 && v.current_version() == 5 && v.oldest_version() == 3, "VersionedTreap::commit");
+        check(v.at(4).size() == 4 && v.current().size() == 5, "VersionedTreap::at");
+        vector<VersionedTreap<Sized>::VersionStats> stats = v.stats();
+        check(stats.size() == 3 && stats[2].live == 5 && v.distinct_nodes() < 12 && v.memory_bytes() > 0,
+              "VersionedTreap::stats");
+        passed("VersionedTreap");
+    }
 
-                //intersect the stuff smaller than v1->key
-                shared_ptr<Node> left = intersect_helper(v1->left, r1);
-                //intersect the stuff larger than v1->key
-                shared_ptr<Node> right = intersect_helper(v1->right, r2);
+    //PersistBlockTreap, with the default order and with ReverseCompare
+    static void block_treap() {
+        typedef PersistBlockTreap<int, int, 8> Block;
+        typedef PersistBlockTreap<int, int, 8, allocator<char>, SharedRef, RandomPriority, ReverseCompare<>> Reversed;
+        vector<pair<int, int>> e = evens(20);
+        Block t = Block::from_sorted(e.begin(), e.end());
+        check(t.size() == 20 && !t.empty() && Block().empty() && t.block_count() < 20, "from_sorted");
+        check(t.insert(5, 50).contains(5) && !t.contains(5) && *t.find(8) == 80 && !t.find(9), "insert");
+        check(!t.erase(8).contains(8) && t.erase(8).size() == 19 && t.erase(9).size() == 20, "erase");
+        pair<Block, Block> halves = t.split(20);
+        check(halves.first.size() == 10 && Block::concat(halves.first, halves.second).size() == 20, "split");
+        check(throws_invalid_argument([&] { Block::concat(halves.second, halves.first); }), "concat");
+        int sum = 0;
+        t.for_each([&sum](const int& k, const int&) { sum += k; });
+        t.for_each_range(10, 14, [&sum](const int& k, const int&) { sum += k; });
+        check(sum == 380 + 22, "for_each");
+        Block grown;
+        for (int k = 0; k < 200; k++) {
+            grown = grown.insert((k * 37) % 200, k);
+        }
+        check(grown.size() == 200 && grown.block_count() > 200 / 8 && *grown.find(37) == 1, "insert into full blocks");
 
-                if (!a) {
-                    //v1->key does not exist in v2, so v1 should not appear in the output.
-                    //Instead, join left and right
-                    return join(left, right);
-                } else {
-                    //make a clone of v1
-                    shared_ptr<Node> w = make_shared<Node>();
-                    w->key = v1->key;
-                    w->val = v1->val;
-                    w->p = v1->p;
-                    w->left = left;
-                    w->right = right;
-                    return w;
-                }
+        vector<pair<int, int>> down(e.rbegin(), e.rend());
+        Reversed b = Reversed::from_sorted(down.begin(), down.end());
+        for (int k = 1; k < 40; k += 2) {
+            b = b.insert(k, 10 * k);
+        }
+        vector<int> order;
+        b.split(20).first.for_each([&order](const int& k, const int&) { order.push_back(k); });
+        check(order.size() == 19 && order.front() == 39 && order.back() == 21 && *b.find(21) == 210,
+              "ReverseCompare");
 
+        //the && overloads against the const& ones and a map, on a mix of versions kept and dropped
+        map<int, int> expected;
+        Block m;
+        mt19937 rng(3);
+        for (int i = 0; i < 3000; i++) {
+            int k = int(rng() % 500);
+            //keeping the old version around now and then makes the && overloads copy its blocks
+            Block kept = i % 5 == 0 ? m : Block();
+            if (rng() % 3 == 0) {
+                expected.erase(k);
+                m = i % 2 ? move(m).erase(k) : m.erase(k);
             } else {
-                //v2 is potentially the new root, so split v1 around v2->key
-                shared_ptr<Node> r1, r2, a;
-                tie(r1, r2, a) = split(v1, v2->key);
+                expected[k] = i;
+                m = i % 2 ? move(m).insert(k, i) : m.insert(k, i);
+            }
+            if (i % 100 == 0) {
+                pair<Block, Block> cut = move(m).split(k);
+                check(cut.first.size() == size_t(distance(expected.begin(), expected.lower_bound(k))), "split &&");
+                m = Block::concat(move(cut.first), move(cut.second));
+            }
+        }
+        vector<pair<int, int>> listed;
+        m.for_each([&listed](const int& k, const int& v) { listed.push_back(make_pair(k, v)); });
+        check(listed == vector<pair<int, int>>(expected.begin(), expected.end()) && m.size() == expected.size(),
+              "insert and erase &&");
 
-                //intersect the stuff smaller and larger than v2->key
-                shared_ptr<Node> left = intersect_helper(r1, v2->left);
-                shared_ptr<Node> right = intersect_helper(r2, v2->right);
+        //a block nothing else holds is changed in place
+        Block owned = Block::from_sorted(e.begin(), e.end());
+        const int* slot = owned.find(8);
+        owned = move(owned).insert(8, 81);
+        check(owned.find(8) == slot && *slot == 81, "insert && in place");
 
-                if (!a) {
-                    //v2->key is not in v1, so join left and right ignoring v2 itself
-                    return join(left, right);
-                } else {
-                    //make a clone of v2
-                    shared_ptr<Node> w = make_shared<Node>();
-                    w->key = v2->key;
-                    w->val = a->val; //use the value from v1 so the intersect is left-biased
-                    w->p = v2->p;
-                    w->left = left;
-                    w->right = right;
-                    return w;
-                }
-            }
+        //blocks of two on a path, which would be a recursion as deep as the treap
+        typedef PersistBlockTreap<int, int, 2, allocator<char>, SharedRef, KeyPriority> Path;
+        vector<pair<int, int>> many = evens(200000);
+        Path deep = Path::from_sorted(many.begin(), many.end());
+        pair<Path, Path> deep_halves = deep.split(2 * 199990 + 1);
+        Path rejoined = Path::concat(deep_halves.first.erase(2 * 199990), deep_halves.second).insert(1, 10);
+        check(deep_halves.first.size() == 199991 && rejoined.size() == 200000 && *rejoined.find(1) == 10 &&
+              !rejoined.contains(2 * 199990) && move(rejoined).erase(0).size() == 199999, "deep PersistBlockTreap");
+        passed("PersistBlockTreap");
+    }
+
+    //the const iterators, seek, and range
+    static void iterators() {
+        Plain t = evens_treap<Plain>(20);
+        Plain::const_iterator it = t.seek(11);
+        check(it->key == 12 && (++it)->key == 14 && (--it)->key == 12 && (it++)->key == 12 && (it--)->key == 14,
+              "const_iterator");
+        check(it == t.seek(12) && t.seek(39) == t.end() && t.begin()->key == 0 && distance(t.begin(), t.end()) == 20,
+              "seek");
+        Plain::const_iterator last = t.end();
+        check((--last)->key == 38 && Plain().begin() == Plain().end(), "end");
+        vector<int> keys;
+        for (const Plain::Entry& entry : t.range(10, 20)) {
+            keys.push_back(entry.key);
         }
+        check(keys == vector<int>{10, 12, 14, 16, 18} && t.range(20, 10).begin() == t.range(20, 10).end(), "range");
+        keys.clear();
+        for (const Plain::Entry& entry : t) {
+            keys.push_back(entry.key);
+        }
+        check(keys == keys_of(t), "begin and end");
+        passed("iterators");
+    }
 
-        //------------------------------------------------------------------------------------------------------------
-        // Difference
-        //------------------------------------------------------------------------------------------------------------
+    //Each update on a temporary, as in t = move(t).insert(k, v), gives the same treap as on a treap still in
+    //use, and changes the nodes only it holds in place
+    static void moves() {
+        Plain t = evens_treap<Plain>(20);
+        auto twice = [](const int& v) { return 2 * v; };
+        check(elements(Plain(t).insert(5, 50)) == elements(t.insert(5, 50)), "insert &&");
+        check(Plain(t).insert_or_assign(5, 51).second && !Plain(t).insert_or_assign(4, 41).second, "insert_or_assign &&");
+        check(elements(Plain(t).erase(4)) == elements(t.erase(4)) && elements(Plain(t).erase(5)) == elements(t),
+              "erase &&");
+        check(elements(Plain(t).remove(6)) == elements(t.remove(6)), "remove &&");
+        check(elements(Plain(t).update(4, twice)) == elements(t.update(4, twice)) &&
+              elements(Plain(t).update(5, twice)) == elements(t), "update &&");
+        vector<pair<int, int>> odds{{3, 30}, {1, 10}};
+        vector<int> gone{0, 38};
+        check(elements(Plain(t).insert_batch(odds.begin(), odds.end())) == elements(t.insert_batch(odds.begin(), odds.end())),
+              "insert_batch &&");
+        check(elements(Plain(t).erase_batch(gone.begin(), gone.end())) == elements(t.erase_batch(gone.begin(), gone.end())),
+              "erase_batch &&");
+        Parallel par(2);
+        check(elements(Plain(t).insert_batch(odds.begin(), odds.end(), par)) == elements(t.insert_batch(odds.begin(), odds.end())),
+              "insert_batch par &&");
+        check(elements(Plain(t).erase_batch(gone.begin(), gone.end(), par)) == elements(t.erase_batch(gone.begin(), gone.end())),
+              "erase_batch par &&");
 
-        static shared_ptr<Node> difference_helper(shared_ptr<Node> v1, shared_ptr<Node> v2) {
-            //TODO: you write this
-	    if (!v1) {
-                return NULL;
-            } else if (!v2) {
-                return v1;	
-            } else {//used to be (v1->p < v2->p)
-                //v1 is potentially the new root, so split v2 around v1->key
-                shared_ptr<Node> r1, r2, a;
-                tie(r1, r2, a) = split(v2, v1->key);
+        //t is the only holder of its nodes here, so the path to 38 is changed in place, root included
+        const void* root = root_id(t);
+        t = move(t).update(38, twice);
+        check(root_id(t) == root && *t.find(38) == 760, "update && in place");
+        passed("transient updates");
+    }
 
-                //intersect the stuff smaller than v1->key
-                shared_ptr<Node> left = difference_helper(v1->left, r1);
-                //intersect the stuff larger than v1->key
-                shared_ptr<Node> right = difference_helper(v1->right, r2);
+    //save and open_mmap, and the Mapped view
+    static void snapshots() {
+        vector<pair<int, int>> e = evens(20);
+        Plain t = Plain::from_sorted(e.begin(), e.end());
+        string path = "/tmp/persist-treap-tour." + to_string(getpid());
+        t.save(path);
+        {
+            Plain::Mapped m = Plain::open_mmap(path);
+            int total = 0;
+            m.for_each([&total](const Plain::Entry& entry) { total += entry.key; });
+            int part = 0;
+            m.for_each_range(10, 14, [&part](const Plain::Entry& entry) { part += entry.key; });
+            check(m.size() == 20 && *m.find(8) == 80 && m.contains(38) && !m.contains(9), "Mapped::find");
+            check(m.lower_bound(9)->key == 10 && !m.lower_bound(39) && total == 380 && part == 22, "Mapped::for_each");
+            check(elements(m.load()) == e, "Mapped::load");
+        }
+        FILE* f = fopen(path.c_str(), "wb");
+        fputs("not a snapshot", f);
+        fclose(f);
+        bool threw = false;
+        try {
+            Plain::open_mmap(path);
+        } catch (const runtime_error&) {
+            threw = true;
+        }
+        unlink(path.c_str());
+        check(threw, "open_mmap on a file that isn't a snapshot");
+        passed("snapshots");
+    }
 
-                if (!a) {
-                    //v1->key does not exist in v2, so v1 should appear in the output.
-		    //make a clone of v1
-                    shared_ptr<Node> w = make_shared<Node>();
-                    w->key = v1->key;
-                    w->val = v1->val;
-                    w->p = v1->p;
-                    w->left = left;
-                    w->right = right;
-                    return w;
-                } else {
-		    //v1 exists in v2
-                    //join left and right
-                     return join(left, right);
-                }
-            }
+    //write_delta writes what newer adds to older, and apply_delta rebuilds newer from older and the delta
+    static void deltas() {
+        vector<pair<int, int>> e = evens(200);
+        Plain t = Plain::from_sorted(e.begin(), e.end());
+        Plain newer = t.insert(5, 50).erase(6).update(100, [](const int& v) { return v + 1; });
+        stringstream delta;
+        Plain::write_delta(t, newer, delta);
+        check(delta.str().size() < 200 * sizeof(Plain::Entry), "write_delta only writes the changed paths");
+        check(elements(Plain::apply_delta(t, delta)) == elements(newer), "apply_delta");
+        stringstream cut(delta.str().substr(0, delta.str().size() / 2));
+        bool threw = false;
+        try {
+            Plain::apply_delta(t, cut);
+        } catch (const runtime_error&) {
+            threw = true;
         }
+        check(threw, "apply_delta on a truncated delta");
+        passed("deltas");
+    }
 
-        //------------------------------------------------------------------------------------------------------------
-        // Debug print
-        //------------------------------------------------------------------------------------------------------------
+    //TreapStats counts the calls, clones, and allocations of each operation in a PERSIST_TREAP_STATS=1 build
+    static void stats() {
+        if (!TreapStats::enabled) {
+            passed("TreapStats (not enabled in this build)");
+            return;
+        }
+        TreapStats::reset();
+        Plain t = evens_treap<Plain>(100);
+        t = t.erase(50);
+        array<TreapStats::OpStats, TreapStats::NUM_OPS> s = TreapStats::snapshot();
+        uint64_t nodes = 0;
+        for (const TreapStats::OpStats& op : s) {
+            nodes += op.nodes_allocated;
+        }
+        check(s[TreapStats::INSERT].calls == 100 && s[TreapStats::ERASE].calls == 1 && nodes >= 100 &&
+              s[TreapStats::INSERT].refcount_ops > 0 && s[TreapStats::ERASE].clones > 0, "TreapStats");
+        passed("TreapStats");
+    }
 
-        static void debug_print_helper(shared_ptr<Node> v, int indent) {
-            //print the tree via a pre-order traversal.  We print the node, then print
-            //its children at one larger indent level.
-            if (v) {
-                if (indent) {
-                    cout << setw(indent) << " ";
+    //health() and sharing(), with their JSON
+    static void health_reports() {
+        vector<pair<int, int>> e = evens(20);
+        Plain t = Plain::from_sorted(e.begin(), e.end());
+        ostringstream json;
+        Plain::Health h = t.health();
+        h.write_json(json);
+        size_t counted = 0;
+        for (size_t n : h.depth_histogram) {
+            counted += n;
+        }
+        check(h.nodes == 20 && h.height >= 5 && h.height == h.depth_histogram.size() && counted == 20 &&
+              Plain().health().height == 0, "health");
+        Plain versions[] = {t, t.insert(5, 50)};
+        Plain::Sharing s = Plain::sharing(versions, versions + 2);
+        s.write_json(json);
+        check(s.versions == 2 && s.total_live_nodes == 41 && s.distinct_nodes < s.total_live_nodes &&
+              s.per_version[1].unique > 0, "sharing");
+        check(json.str().find("\"depth_histogram\"") != string::npos && json.str().find("\"per_version\"") != string::npos,
+              "write_json");
+        passed("health reports");
+    }
+
+    //count_less agrees with lower_bound, for the key types that have a vectorized BlockSearch here
+    template <typename T>
+    static void block_search() {
+        if constexpr (BlockSearch<T>::vectorized) {
+            T keys[40];
+            for (int i = 0; i < 40; i++) {
+                keys[i] = T(3 * i);
+            }
+            for (int k = -1; k < 125; k++) {
+                for (unsigned n = 0; n <= 40; n++) {
+                    unsigned expected = unsigned(std::lower_bound(keys, keys + n, T(k)) - keys);
+                    check(BlockSearch<T>::count_less(keys, n, T(k)) == expected, "BlockSearch::count_less");
                 }
-                cout << v->key << ":" << v->p << ":" << v->val << endl;
-                debug_print_helper(v->left, indent+4);
-                debug_print_helper(v->right, indent+4);
             }
         }
+    }
 
-    public:
+    //find_batch on both treaps gives what find gives, and the vectorized block search what lower_bound does
+    static void batched_lookups() {
+        vector<pair<int, int>> e = evens(1000);
+        Plain t = Plain::from_sorted(e.begin(), e.end());
+        PersistBlockTreap<int, int> b = PersistBlockTreap<int, int>::from_sorted(e.begin(), e.end());
+        vector<int> probes;
+        for (int k = -3; k < 2010; k += 3) {
+            probes.push_back(k);
+        }
+        vector<const int*> found(probes.size()), block_found(probes.size());
+        t.find_batch(probes.begin(), probes.end(), found.begin());
+        b.find_batch(probes.begin(), probes.end(), block_found.begin());
+        for (size_t i = 0; i < probes.size(); i++) {
+            check(found[i] == t.find(probes[i]) && block_found[i] == b.find(probes[i]), "find_batch");
+        }
+        block_search<int>();
+        block_search<int64_t>();
+        block_search<float>();
+        block_search<double>();
+        passed("batched lookups");
+    }
 
-        //A constructor that initializes the treap to the empty treap using the fact that
-        //the root shared_ptr is initialized to nil by the shared_ptr constructor.
-        PersistTreap() {}
+    //keys ordered by a Compare policy: ReverseCompare, and the compare member of string keys
+    static void comparators() {
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, NoAugment, RandomPriority, ReverseCompare<>> Reversed;
+        Reversed t = evens_treap<Reversed>(20);
+        check(t.min()->key == 38 && t.begin()->key == 38 && t.lower_bound(9)->key == 8 && keys_of(t).back() == 0,
+              "ReverseCompare");
+        PersistTreap<string, int> s;
+        s = s.insert("pear", 1).insert("apple", 2).insert("fig", 3).insert("apple", 4);
+        check(s.min()->key == "apple" && s.max()->key == "pear" && *s.find("apple") == 4 && !s.find("kiwi"),
+              "string keys");
+        passed("comparators");
+    }
 
-        //A constructor to construct a tree consisting of a single node.
-        PersistTreap(Tkey key, Tval val) {
-            root = make_shared<Node>();
-            root->key = key;
-            root->val = val;
-            root->p = rand() ;//%1000; // added % 100; for easier reading of p values
+    //union_all and intersect_all over many treaps, sequential and on the ForkJoinPool
+    static void k_way() {
+        vector<pair<int, int>> e = evens(300);
+        vector<Plain> shards;
+        for (int i = 0; i < 3; i++) {
+            shards.push_back(Plain::from_sorted(e.begin() + 100 * i, e.begin() + 100 * i + 150 > e.begin() + 300
+                                                ? e.end() : e.begin() + 100 * i + 150));
         }
+        check(elements(Plain::union_all(shards.begin(), shards.end())) == e, "union_all");
+        check(Plain::intersect_all(shards.begin(), shards.end()).empty() &&
+              keys_of(Plain::intersect_all(shards.begin(), shards.begin() + 2)).size() == 50, "intersect_all");
+        Parallel par(2);
+        check(elements(Plain::union_all(shards.begin(), shards.end(), par)) == e, "union_all par");
+        check(keys_of(Plain::intersect_all(shards.begin(), shards.begin() + 2, par)).size() == 50, "intersect_all par");
+        check(Plain::union_all(shards.begin(), shards.begin()).empty(), "union_all of nothing");
+        check(elements(Plain::union_all(make_move_iterator(shards.begin()), make_move_iterator(shards.end()))) == e,
+              "union_all of moved shards");
+        passed("union_all");
+    }
 
-        static PersistTreap treap_union(PersistTreap treap1, PersistTreap treap2) {
-            //call union_helper, unwrapping and then re-wrapping the PersistTree into a shared_ptr<Node>
-            PersistTreap newTreap;
-            newTreap.root = union_helper(treap1.root, treap2.root);
-            return newTreap;
-        }
+    //split_at, concat, and extract_range
+    static void partitions() {
+        vector<pair<int, int>> e = evens(20);
+        Plain t = Plain::from_sorted(e.begin(), e.end());
+        pair<Plain, Plain> halves = t.split_at(20);
+        check(keys_of(halves.first).size() == 10 && halves.second.min()->key == 20 &&
+              elements(Plain(t).split_at(21).second) == vector<pair<int, int>>(e.begin() + 11, e.end()), "split_at");
+        check(elements(Plain::concat(halves.first, halves.second)) == e, "concat");
+        check(throws_invalid_argument([&] { Plain::concat(halves.second, halves.first); }), "concat overlapping");
+        pair<Plain, Plain> cut = t.extract_range(10, 20);
+        check(keys_of(cut.first) == vector<int>{10, 12, 14, 16, 18} && keys_of(cut.second).size() == 15,
+              "extract_range");
+        check(elements(Plain(t).extract_range(10, 20).second) == elements(cut.second), "extract_range &&");
+        passed("partitions");
+    }
 
-        static PersistTreap intersection(PersistTreap treap1, PersistTreap treap2) {
-            //call intersect_helper, unwrapping and then re-wrapping the PersistTree into a shared_ptr<Node>
-            PersistTreap newTreap;
-            newTreap.root = intersect_helper(treap1.root, treap2.root);
-            return newTreap;
-        }
+    //apply_range leaves an update pending on the nodes of a range, which get, for_each, and the updates apply
+    static void lazy_updates() {
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, Augments<SizeAugment, LazyUpdate<AddTag<int>>>> Lazy;
+        vector<pair<int, int>> e = evens(20);
+        Lazy t = Lazy::from_sorted(e.begin(), e.end());
+        Lazy u = t.apply_range(10, 20, 1);
+        check(*u.get(10) == 101 && *u.get(20) == 200 && *t.get(10) == 100 && !u.get(11), "apply_range");
+        u = move(u).apply_range(0, 40, 1);
+        check(*u.get(0) == 1 && *u.get(12) == 122, "apply_range &&");
+        int sum = 0;
+        u.for_each([&sum](const int&, const int& v) { sum += v; });
+        check(sum == 3800 + 5 + 20, "for_each");
+        sum = 0;
+        u.for_each_range(10, 14, [&sum](const int&, const int& v) { sum += v; });
+        check(sum == 102 + 122, "for_each_range");
+        pair<Lazy, Lazy> halves = u.split_at(12);
+        Lazy joined = Lazy::concat(halves.first, halves.second.insert(13, 0).erase(13));
+        check(joined.size() == 20 && *joined.get(12) == 122 && *joined.update(12, [](const int& v) { return -v; }).get(12) == -122,
+              "updates below a pending update");
+        passed("lazy updates");
+    }
 
-        static PersistTreap difference(PersistTreap treap1, PersistTreap treap2) {
-            //TODO: you write this
-	    PersistTreap newTreap;
-            newTreap.root = difference_helper(treap1.root, treap2.root);
-            return newTreap;
+    //values that count how many of them exist, to see when nodes are freed
+    struct Tracked {
+        static atomic<int>& live() {
+            static atomic<int> n(0);
+            return n;
         }
 
-        PersistTreap insert(Tkey key, Tval val) {
-            return treap_union(PersistTreap(key, val), *this);
+        Tracked() { live()++; }
+        Tracked(const Tracked&) { live()++; }
+        Tracked& operator=(const Tracked&) = default;
+        ~Tracked() { live()--; }
+    };
+
+    //Dropping a treap frees every node in each Reclaimer mode, once flush has run
+    static void reclamation() {
+        typedef PersistTreap<int, Tracked> Treap;
+        for (Reclaimer::Mode m : {Reclaimer::DEFERRED, Reclaimer::BACKGROUND, Reclaimer::IMMEDIATE}) {
+            Reclaimer::set_mode(m);
+            Treap t;
+            {
+                vector<pair<int, Tracked>> e(1000);
+                for (int i = 0; i < 1000; i++) {
+                    e[i].first = i;
+                }
+                t = Treap::from_sorted(e.begin(), e.end());
+            }
+            check(Tracked::live() == 1000, "one value per node");
+            t = Treap();
+            Reclaimer::flush();
+            check(Tracked::live() == 0, "Reclaimer::flush");
         }
+        passed("reclamation");
+    }
 
-        PersistTreap remove(Tkey key) {
-            return difference(*this, PersistTreap(key, NULL));
+    //seek_from, find_from, append, the Appender, and insert_hint
+    static void fingers() {
+        vector<pair<int, int>> e = evens(20);
+        Plain t = Plain::from_sorted(e.begin(), e.end());
+        Plain::const_iterator it = t.seek(12);
+        check(t.seek_from(it, 31)->key == 32 && t.seek_from(t.seek(30), 3)->key == 4 && t.seek_from(it, 39) == t.end() &&
+              t.seek_from(t.end(), 7)->key == 8, "seek_from");
+        check(t.find_from(it, 30)->key == 30 && t.find_from(it, 31) == t.end(), "find_from");
+        check(t.append(40, 400).max()->key == 40 && keys_of(Plain(t).append(40, 400)).size() == 21 &&
+              throws_invalid_argument([&] { t.append(38, 0); }), "append");
+        Plain::Appender app;
+        check(app.empty() && app.treap().empty(), "Appender::empty");
+        for (const pair<int, int>& p : e) {
+            app.append(p.first, p.second);
         }
+        Plain snapshot = app.treap();
+        app.append(40, 400);
+        check(elements(snapshot) == e && keys_of(app.treap()).size() == 21 && throws_invalid_argument([&] { app.append(1, 0); }),
+              "Appender");
+        Plain::Appender more(t);
+        more.append(40, 400);
+        check(elements(more.treap()) == elements(t.append(40, 400)), "Appender from a treap");
+        check(t.insert_hint(t.end(), 40, 400).contains(40) && *Plain(t).insert_hint(t.seek(10), 9, 90).find(9) == 90,
+              "insert_hint");
 
-        void debug_print() {
-            debug_print_helper(root, 0);
+        //insert_hint from every element, for new keys and keys that are there, near and far from the hint, on a
+        //treap whose augmented data would show a clone that wasn't pulled
+        typedef PersistTreap<int, int, allocator<char>, SharedRef, Augments<SizeAugment, Aggregate<SumMonoid<int>>>> Sized;
+        Sized s = Sized::from_sorted(e.begin(), e.end());
+        for (Sized::const_iterator h = s.begin(); h != s.end(); ++h) {
+            for (int k : {-1, 0, h->key - 1, h->key, h->key + 1, h->key + 9, 17, 39, 41}) {
+                Sized hinted = s.insert_hint(h, k, 7);
+                Sized plain = s.insert(k, 7);
+                check(elements(hinted) == elements(plain) && hinted.size() == plain.size() &&
+                      hinted.aggregate() == plain.aggregate() && hinted.aggregate(0, 20) == plain.aggregate(0, 20),
+                      "insert_hint from every element");
+                check(elements(Sized(s).insert_hint(h, k, 7)) == elements(plain), "insert_hint &&");
+            }
         }
+        passed("finger operations");
+    }
+
+    void all() {
+        point_updates<PersistTreap<int, int, PoolAllocator<char>>>("PoolAllocator");
+        point_updates<PersistTreap<int, int, allocator<char>, IntrusiveRef<false>>>("IntrusiveRef<false>");
+        point_updates<PersistTreap<int, int, allocator<char>, IntrusiveRef<true>>>("IntrusiveRef<true>");
+        deep_treaps();
+        parallel_set_ops<Plain>("parallel set operations");
+        parallel_set_ops<PersistTreap<int, int, allocator<char>, IntrusiveRef<true>, SizeAugment>>(
+            "parallel set operations with SizeAugment");
+        forks_from_threads();
+        point_updates<Plain>("PersistTreap");
+        lookups();
+        order_statistics();
+        aggregates();
+        concurrent();
+        bulk_build();
+        batches();
+        priorities();
+        hash_consing();
+        shared_subtrees();
+        versions();
+        block_treap();
+        iterators();
+        moves();
+        snapshots();
+        deltas();
+        stats();
+        health_reports();
+        batched_lookups();
+        comparators();
+        k_way();
+        partitions();
+        lazy_updates();
+        reclamation();
+        fingers();
+    }
 };
 
-int main() {
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        TreapBench().all(argc > 2 ? size_t(atof(argv[2])) : size_t(1000000));
+        if (TreapStats::enabled) {
+            cout << endl;
+            TreapStats::print(cout);
+        }
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "tour") == 0) {
+        TreapTour().all();
+        return 0;
+    }
+
     srand(time(0));
 
     //create a treap of the first 0 through 39
@@ -467,4 +7444,10 @@ int main() {
     //now print treap1 again to see that it is unchanged even though nodes are shared between treap1 and treap3
     cout << endl << "Treap 1 again" << endl;
     treap1.debug_print();
+
+    //update replaces a value with a function of the old one, again leaving treap1 alone
+    cout << endl << "Treap 6 = treap 1 with the value of 4 doubled" << endl;
+    PersistTreap<int, int> treap6 = treap1.update(4, [](const int& v) { return v * 2; });
+    treap6.debug_print();
+
 }